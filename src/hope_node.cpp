@@ -162,6 +162,11 @@ int main(int argc, char **argv)
   cout << "Using threshold: xy@" << xy_resolution << " " << "z@" << z_resolution << endl;
 
   PlaneSegment hope(type, xy_resolution, z_resolution);
+
+  // Summed change in meter of the plane z and bounds allowed to keep the plane ID
+  ros::NodeHandle pnh("~");
+  double id_gate;
+  if (pnh.getParam("plane_id_gate", id_gate)) hope.setIDGate(float(id_gate));
   PointCloud::Ptr src_cloud(new PointCloud); // Cloud input for all pipelines
 
   if (type == SYN) {
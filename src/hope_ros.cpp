@@ -23,17 +23,20 @@ int main(int argc, char **argv)
   float z_resolution = 0.02; // In meter
   string base_frame = "base_link"; // plane reference frame
   string cloud_topic = "/point_cloud";
+  vector<string> object_models; // .pcd files of the objects for mesh pose estimation
 
   // Servo's max angle to rotate
   pnh.getParam("base_frame", base_frame);
   pnh.getParam("cloud_topic", cloud_topic);
   pnh.getParam("xy_resolution", xy_resolution);
   pnh.getParam("z_resolution", z_resolution);
+  pnh.getParam("object_models", object_models);
 
   cout << "Using threshold: xy@" << xy_resolution 
        << " " << "z@" << z_resolution << endl;
 
   PlaneSegmentRT hope(xy_resolution, z_resolution, nh, base_frame, cloud_topic);
+  hope.preloadObjectModels(object_models);
 
   while (ros::ok()) {
     hope.getHorizontalPlanes();
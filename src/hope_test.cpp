@@ -4,6 +4,7 @@
 
 #include "lib/utilities.h"
 #include "lib/pose_estimation.h"
+#include "lib/contour_mask.h"
 
 
 #define DEBUG
@@ -48,6 +49,100 @@ bool testCVRotatedRect() {
   Utilities::getRotatedRect2D(hull, rect,center,edge_center,width,height,rotation);
 }
 
+// Sample the faces of the box [min, max] with given step, the normals point outward
+void addBoxSurface(const Eigen::Vector3f &min, const Eigen::Vector3f &max, float step,
+                   PointCloudN::Ptr &cloud) {
+  for (int axis = 0; axis < 3; ++axis) {
+    int u = (axis + 1) % 3;
+    int v = (axis + 2) % 3;
+    for (int side = 0; side < 2; ++side) {
+      for (float a = min[u]; a <= max[u] + 1e-6f; a += step) {
+        for (float b = min[v]; b <= max[v] + 1e-6f; b += step) {
+          PointN p;
+          float *xyz = &p.x;
+          float *normal = &p.normal_x;
+          xyz[axis] = side ? max[axis] : min[axis];
+          xyz[u] = a;
+          xyz[v] = b;
+          normal[axis] = side ? 1 : -1;
+          normal[u] = 0;
+          normal[v] = 0;
+          cloud->points.push_back(p);
+        }
+      }
+    }
+  }
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+}
+
+// An object without rotational symmetry about z: a box with a smaller block on one corner
+PointCloudN::Ptr makeTestObject(float step) {
+  PointCloudN::Ptr cloud(new PointCloudN);
+  addBoxSurface(Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(0.12, 0.08, 0.04), step, cloud);
+  addBoxSurface(Eigen::Vector3f(0, 0, 0.04), Eigen::Vector3f(0.04, 0.03, 0.08), step, cloud);
+  return cloud;
+}
+
+// Check that the estimated transformation is within the given errors of the ground truth
+bool isCloseTransform(const Eigen::Matrix4f &est, const Eigen::Matrix4f &gt, float angle_th, float dis_th) {
+  Eigen::Matrix3f rot_err = est.block<3, 3>(0, 0).transpose() * gt.block<3, 3>(0, 0);
+  float angle = Eigen::AngleAxisf(rot_err).angle();
+  float dis = (est.block<3, 1>(0, 3) - gt.block<3, 1>(0, 3)).norm();
+  cout << "  angle error " << angle << " translation error " << dis << endl;
+  return angle < angle_th && dis < dis_th;
+}
+
+bool testAlignment4DoF() {
+  const float leaf = 0.005f;
+  PointCloudN::Ptr model = makeTestObject(leaf);
+
+  // The object is turned by yaw and moved in xy, and the plane is raised
+  Eigen::Matrix4f gt = Eigen::Matrix4f::Identity();
+  gt.block<3, 3>(0, 0) = Eigen::AngleAxisf(0.6f, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+  gt(0, 3) = 0.3f;
+  gt(1, 3) = -0.2f;
+  gt(2, 3) = 0.05f;
+  PointCloudN::Ptr scene(new PointCloudN);
+  pcl::transformPointCloudWithNormals(*model, *scene, gt);
+
+  PointCloudFPFH::Ptr model_features(new PointCloudFPFH);
+  PointCloudFPFH::Ptr scene_features(new PointCloudFPFH);
+  Utilities::estimateFPFH(model, model_features, leaf);
+  Utilities::estimateFPFH(scene, scene_features, leaf);
+
+  Eigen::Matrix4f trans;
+  float fitness, inlier_ratio;
+  bool ok = Utilities::alignment4DoF(model, model_features, scene, scene_features, gt(2, 3), trans,
+                                     leaf, 0.99f, fitness, inlier_ratio);
+  return ok && isCloseTransform(trans, gt, 0.02f, leaf);
+}
+
+bool testRefinePointToPlane() {
+  const float leaf = 0.005f;
+  PointCloudN::Ptr model = makeTestObject(leaf);
+
+  Eigen::Matrix4f gt = Eigen::Matrix4f::Identity();
+  gt.block<3, 3>(0, 0) = Eigen::AngleAxisf(0.3f, Eigen::Vector3f(1, 2, 3).normalized()).toRotationMatrix();
+  gt(0, 3) = 0.1f;
+  gt(1, 3) = 0.2f;
+  gt(2, 3) = 0.3f;
+  PointCloudN::Ptr scene(new PointCloudN);
+  pcl::transformPointCloudWithNormals(*model, *scene, gt);
+
+  // Start from a small 6-DoF perturbation of the ground truth
+  Eigen::Matrix4f delta = Eigen::Matrix4f::Identity();
+  delta.block<3, 3>(0, 0) = Eigen::AngleAxisf(0.03f, Eigen::Vector3f(-1, 1, 2).normalized()).toRotationMatrix();
+  delta(0, 3) = 0.004f;
+  delta(1, 3) = -0.003f;
+  delta(2, 3) = 0.002f;
+  Eigen::Matrix4f trans = gt * delta;
+
+  float rms, inlier_ratio;
+  bool ok = Utilities::refinePointToPlane(model, scene, trans, 2.5f * leaf, 30, rms, inlier_ratio);
+  return ok && isCloseTransform(trans, gt, 0.002f, 0.0005f);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -80,10 +175,19 @@ int main(int argc, char **argv)
   ok = Utilities::isInContour(contour, p);
   cout << "res 3: " << ok << endl;  // should be true
 
+  ContourMask mask;
+  mask.build(contour, 0.05);
+  cout << "res 4: " << mask.isInside(0.9, 0) << endl;  // should be true
+  cout << "res 5: " << mask.isInside(2, 0) << endl;  // should be false
+  cout << "res 6: " << mask.isInside(1, 0) << endl;  // should be true
+
   testQuaternionFromMatrix();
 
   testCVRotatedRect();
 
+  cout << "res 7: " << testAlignment4DoF() << endl;  // should be true
+  cout << "res 8: " << testRefinePointToPlane() << endl;  // should be true
+
 //  float dsp_th = 0.005f;
 //  PoseEstimation *pe = new PoseEstimation(dsp_th);
 //  std::string scene_path = "/home/dzp/scene.pcd";
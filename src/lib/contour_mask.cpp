@@ -0,0 +1,165 @@
+#include "contour_mask.h"
+
+#include <algorithm>
+
+using namespace std;
+
+const int batch_size_ = 256; // Number of points whose cells are computed in one batch
+
+ContourMask::ContourMask() :
+  width_(0),
+  height_(0),
+  resolution_(0.01f),
+  origin_x_(0.0f),
+  origin_y_(0.0f)
+{
+}
+
+void ContourMask::build(const PointCloudMono::Ptr& contour, float resolution)
+{
+  resolution_ = resolution;
+  width_ = 0;
+  height_ = 0;
+  cells_.clear();
+  x0_.clear();
+  y0_.clear();
+  x1_.clear();
+  y1_.clear();
+
+  size_t n = contour->points.size();
+  if (n < 3) return;
+
+  float min_x = FLT_MAX, min_y = FLT_MAX;
+  float max_x = -FLT_MAX, max_y = -FLT_MAX;
+  for (size_t i = 0; i < n; ++i) {
+    const pcl::PointXYZ &p = contour->points[i];
+    const pcl::PointXYZ &q = contour->points[(i + 1) % n];
+    x0_.push_back(p.x);
+    y0_.push_back(p.y);
+    x1_.push_back(q.x);
+    y1_.push_back(q.y);
+    min_x = min(min_x, p.x);
+    min_y = min(min_y, p.y);
+    max_x = max(max_x, p.x);
+    max_y = max(max_y, p.y);
+  }
+
+  // Pad one cell on each side so that the boundary cells are always in the grid
+  origin_x_ = min_x - resolution_;
+  origin_y_ = min_y - resolution_;
+  width_ = int(floor((max_x - origin_x_) / resolution_)) + 2;
+  height_ = int(floor((max_y - origin_y_) / resolution_)) + 2;
+  cells_.assign(width_ * height_, OUTSIDE);
+
+  // Scanline fill with the cell centers, a cell is inside if its center is
+  vector<float> xs;
+  for (int r = 0; r < height_; ++r) {
+    float yc = origin_y_ + (r + 0.5f) * resolution_;
+    xs.clear();
+    for (size_t i = 0; i < n; ++i) {
+      if ((y0_[i] <= yc) == (y1_[i] <= yc)) continue;
+      xs.push_back(x0_[i] + (yc - y0_[i]) * (x1_[i] - x0_[i]) / (y1_[i] - y0_[i]));
+    }
+    sort(xs.begin(), xs.end());
+    for (size_t k = 0; k + 1 < xs.size(); k += 2) {
+      int c_begin = max(0, int(ceil((xs[k] - origin_x_) / resolution_ - 0.5f)));
+      int c_end = min(width_ - 1, int(floor((xs[k + 1] - origin_x_) / resolution_ - 0.5f)));
+      for (int c = c_begin; c <= c_end; ++c) {
+        cells_[r * width_ + c] = INSIDE;
+      }
+    }
+  }
+
+  // Cells touched by the contour can not be decided by their centers
+  for (size_t i = 0; i < n; ++i) {
+    markSegment(x0_[i], y0_[i], x1_[i], y1_[i]);
+  }
+}
+
+void ContourMask::markSegment(float xa, float ya, float xb, float yb)
+{
+  // Samples are at most half a cell apart, so together with the neighbours of
+  // each sampled cell all cells passed by the segment are covered
+  float len = sqrt((xb - xa) * (xb - xa) + (yb - ya) * (yb - ya));
+  int steps = int(ceil(len / (0.5f * resolution_))) + 1;
+  for (int s = 0; s <= steps; ++s) {
+    float t = float(s) / steps;
+    int c = int(floor((xa + t * (xb - xa) - origin_x_) / resolution_));
+    int r = int(floor((ya + t * (yb - ya) - origin_y_) / resolution_));
+    for (int dr = -1; dr <= 1; ++dr) {
+      for (int dc = -1; dc <= 1; ++dc) {
+        int nc = c + dc;
+        int nr = r + dr;
+        if (nc < 0 || nr < 0 || nc >= width_ || nr >= height_) continue;
+        cells_[nr * width_ + nc] = BOUNDARY;
+      }
+    }
+  }
+}
+
+bool ContourMask::crossingTest(float x, float y) const
+{
+  bool inside = false;
+  for (size_t i = 0; i < x0_.size(); ++i) {
+    float ax = x0_[i] - x;
+    float ay = y0_[i] - y;
+    float bx = x1_[i] - x;
+    float by = y1_[i] - y;
+    // (x, y) is on the edge
+    if (ax * by - ay * bx == 0 && ax * bx + ay * by <= 0) return true;
+    if ((y0_[i] > y) != (y1_[i] > y) &&
+        x < x0_[i] + (y - y0_[i]) * (x1_[i] - x0_[i]) / (y1_[i] - y0_[i])) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+bool ContourMask::isInside(float x, float y) const
+{
+  if (!(x >= origin_x_ && y >= origin_y_)) return false;
+  int c = int((x - origin_x_) / resolution_);
+  int r = int((y - origin_y_) / resolution_);
+  if (c >= width_ || r >= height_) return false;
+
+  uint8_t type = cells_[r * width_ + c];
+  if (type == BOUNDARY) return crossingTest(x, y);
+  return type == INSIDE;
+}
+
+void ContourMask::getInliers(const PointCloudMono::Ptr& cloud, float z_min, vector<int> &indices) const
+{
+  indices.clear();
+  if (cells_.empty()) return;
+
+  const float inv_rsl = 1.0f / resolution_;
+  const float span_x = width_ * resolution_;
+  const float span_y = height_ * resolution_;
+  const size_t num = cloud->points.size();
+  int cell_ids[batch_size_];
+
+  for (size_t begin = 0; begin < num; begin += batch_size_) {
+    int batch = int(min(num - begin, size_t(batch_size_)));
+    const pcl::PointXYZ *pts = &cloud->points[begin];
+
+    // Compute the cell of each point without branches, -1 for points lower than z_min
+    // or out of the grid. NaN fails all comparisons and is rejected as well.
+    for (int k = 0; k < batch; ++k) {
+      float dx = pts[k].x - origin_x_;
+      float dy = pts[k].y - origin_y_;
+      bool valid = (pts[k].z >= z_min) & (dx >= 0) & (dy >= 0) & (dx < span_x) & (dy < span_y);
+      int c = min(int((valid ? dx : 0) * inv_rsl), width_ - 1);
+      int r = min(int((valid ? dy : 0) * inv_rsl), height_ - 1);
+      cell_ids[k] = valid ? r * width_ + c : -1;
+    }
+
+    for (int k = 0; k < batch; ++k) {
+      int id = cell_ids[k];
+      if (id < 0) continue;
+      uint8_t type = cells_[id];
+      if (type == INSIDE || (type == BOUNDARY && crossingTest(pts[k].x, pts[k].y))) {
+        indices.push_back(int(begin) + k);
+      }
+    }
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef CONTOUR_MASK_H
+#define CONTOUR_MASK_H
+
+// STL
+#include <vector>
+#include <cstdint>
+
+#include "utilities.h"
+
+
+/**
+ * Point-in-polygon test against a fixed contour in the X-Y plane. The contour is
+ * rasterized once into cells that are fully inside, fully outside or crossed by the
+ * contour. Only the points falling into the crossed cells need the exact crossing
+ * number test, the others are classified by a single lookup.
+ */
+class ContourMask
+{
+public:
+  ContourMask();
+
+  /**
+   * Rasterize the contour into the mask.
+   * @param contour Ordered contour vertices, z values are ignored
+   * @param resolution Edge length of a cell in meter, typically th_grid_rsl_
+   */
+  void build(const PointCloudMono::Ptr& contour, float resolution);
+
+  /**
+   * Get the points of the cloud inside the contour and not lower than z_min.
+   * @param cloud Source cloud
+   * @param z_min Points lower than this are ignored
+   * @param indices Output indices of the points in cloud
+   */
+  void getInliers(const PointCloudMono::Ptr& cloud, float z_min, std::vector<int> &indices) const;
+
+  /// Return true if (x, y) is inside or on the contour
+  bool isInside(float x, float y) const;
+
+private:
+  enum cell_type{OUTSIDE = 0, INSIDE = 1, BOUNDARY = 2};
+
+  int width_;
+  int height_;
+  float resolution_;
+  float origin_x_;
+  float origin_y_;
+  std::vector<uint8_t> cells_;
+
+  // Edge table of the contour, edge i goes from (x0_[i], y0_[i]) to (x1_[i], y1_[i])
+  std::vector<float> x0_;
+  std::vector<float> y0_;
+  std::vector<float> x1_;
+  std::vector<float> y1_;
+
+  /// Exact crossing number test with the edge table, points on edges count as inside
+  bool crossingTest(float x, float y) const;
+
+  /// Mark the cells passed by the segment and their 8-neighbours as boundary
+  void markSegment(float xa, float ya, float xb, float yb);
+};
+
+#endif // CONTOUR_MASK_H
@@ -0,0 +1,222 @@
+#include "model_library.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace {
+
+// Layout of the sidecar file: the header followed by num_points points of
+// point_floats_ floats each, then num_features features of feature_floats_ floats each
+const char sidecar_magic_[8] = {'H', 'O', 'P', 'E', 'M', 'D', 'L', '1'};
+const size_t point_floats_ = 7;
+const size_t feature_floats_ = 33;
+
+struct SidecarHeader
+{
+  char magic[8];
+  float dsp_th;
+  uint32_t reserved;
+  // Modification time and size of the model file the sidecar is computed from
+  int64_t model_mtime;
+  int64_t model_size;
+  uint64_t num_points;
+  uint64_t num_features;
+};
+
+bool getFileStat(const string &path, int64_t &mtime, int64_t &size)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+  mtime = int64_t(st.st_mtime);
+  size = int64_t(st.st_size);
+  return true;
+}
+
+}
+
+ModelLibrary::ModelLibrary(size_t capacity) :
+  capacity_(capacity)
+{
+}
+
+string ModelLibrary::makeKey(const string &path, float dsp_th)
+{
+  // In micrometer to avoid the rounding of float
+  return path + "@" + to_string(long(lround(dsp_th * 1e6)));
+}
+
+string ModelLibrary::sidecarPath(const string &path, float dsp_th)
+{
+  return path + "." + to_string(long(lround(dsp_th * 1e6))) + "um.hopefeat";
+}
+
+ObjectModel::ConstPtr ModelLibrary::get(const string &path, float dsp_th)
+{
+  string key = makeKey(path, dsp_th);
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return *it->second;
+    }
+  }
+
+  // Loading is done without the lock so that cached models are served meanwhile
+  boost::shared_ptr<ObjectModel> model(new ObjectModel);
+  if (!loadSidecar(path, dsp_th, *model)) {
+    if (!compute(path, dsp_th, *model)) {
+      ROS_WARN("HoPE: Failed to load object model %s", path.c_str());
+      return ObjectModel::ConstPtr();
+    }
+    if (!saveSidecar(path, dsp_th, *model)) {
+      ROS_WARN("HoPE: Failed to write the feature file of %s", path.c_str());
+    }
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    // Loaded by another caller in the meantime
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return *it->second;
+  }
+  lru_.push_front(model);
+  index_[key] = lru_.begin();
+  while (lru_.size() > capacity_) {
+    index_.erase(makeKey(lru_.back()->path, lru_.back()->dsp_th));
+    lru_.pop_back();
+  }
+  return model;
+}
+
+void ModelLibrary::preload(const vector<string> &paths, float dsp_th)
+{
+  for (const auto & path : paths) {
+    if (get(path, dsp_th)) {
+      ROS_INFO("HoPE: Object model %s loaded.", path.c_str());
+    }
+  }
+}
+
+bool ModelLibrary::compute(const string &path, float dsp_th, ObjectModel &model)
+{
+  model.path = path;
+  model.dsp_th = dsp_th;
+  model.cloud.reset(new PointCloudN);
+  model.features.reset(new PointCloudFPFH);
+  if (pcl::io::loadPCDFile<PointN>(path, *model.cloud) < 0) return false;
+
+  Utilities::downSampling(model.cloud, model.cloud, dsp_th, dsp_th);
+  Utilities::estimateNormals(model.cloud, model.cloud, dsp_th);
+  Utilities::estimateFPFH(model.cloud, model.features, dsp_th);
+  return !model.cloud->points.empty();
+}
+
+bool ModelLibrary::loadSidecar(const string &path, float dsp_th, ObjectModel &model)
+{
+  int64_t mtime, size;
+  if (!getFileStat(path, mtime, size)) return false;
+
+  string sidecar = sidecarPath(path, dsp_th);
+  int fd = open(sidecar.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SidecarHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t file_size = size_t(st.st_size);
+  void *data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+
+  bool ok = false;
+  SidecarHeader header;
+  memcpy(&header, data, sizeof(header));
+  // The counts come from the file, so they are bounded by its size before being multiplied
+  uint64_t max_floats = (file_size - sizeof(SidecarHeader)) / sizeof(float);
+  bool valid_counts = header.num_points <= max_floats / point_floats_ &&
+      header.num_features <= max_floats / feature_floats_ &&
+      header.num_points * point_floats_ + header.num_features * feature_floats_ == max_floats &&
+      (file_size - sizeof(SidecarHeader)) % sizeof(float) == 0;
+  if (memcmp(header.magic, sidecar_magic_, sizeof(sidecar_magic_)) == 0 &&
+      header.dsp_th == dsp_th && header.model_mtime == mtime && header.model_size == size &&
+      valid_counts) {
+    const float *p = reinterpret_cast<const float *>(static_cast<const char *>(data) + sizeof(SidecarHeader));
+
+    model.path = path;
+    model.dsp_th = dsp_th;
+    model.cloud.reset(new PointCloudN);
+    model.cloud->points.resize(header.num_points);
+    for (auto & pt : model.cloud->points) {
+      pt.x = p[0];
+      pt.y = p[1];
+      pt.z = p[2];
+      pt.normal_x = p[3];
+      pt.normal_y = p[4];
+      pt.normal_z = p[5];
+      pt.curvature = p[6];
+      p += point_floats_;
+    }
+    model.cloud->width = model.cloud->points.size();
+    model.cloud->height = 1;
+
+    model.features.reset(new PointCloudFPFH);
+    model.features->points.resize(header.num_features);
+    for (auto & f : model.features->points) {
+      memcpy(f.histogram, p, feature_floats_ * sizeof(float));
+      p += feature_floats_;
+    }
+    model.features->width = model.features->points.size();
+    model.features->height = 1;
+    ok = true;
+  }
+  munmap(data, file_size);
+  return ok;
+}
+
+bool ModelLibrary::saveSidecar(const string &path, float dsp_th, const ObjectModel &model)
+{
+  SidecarHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, sidecar_magic_, sizeof(sidecar_magic_));
+  header.dsp_th = dsp_th;
+  if (!getFileStat(path, header.model_mtime, header.model_size)) return false;
+  header.num_points = model.cloud->points.size();
+  header.num_features = model.features->points.size();
+
+  // Write to a temporary file and rename, so that readers never see a partial file
+  string sidecar = sidecarPath(path, dsp_th);
+  string tmp = sidecar + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (!fp) return false;
+
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  float buf[point_floats_];
+  for (const auto & pt : model.cloud->points) {
+    if (!ok) break;
+    buf[0] = pt.x;
+    buf[1] = pt.y;
+    buf[2] = pt.z;
+    buf[3] = pt.normal_x;
+    buf[4] = pt.normal_y;
+    buf[5] = pt.normal_z;
+    buf[6] = pt.curvature;
+    ok = fwrite(buf, sizeof(float), point_floats_, fp) == point_floats_;
+  }
+  for (const auto & f : model.features->points) {
+    if (!ok) break;
+    ok = fwrite(f.histogram, sizeof(float), feature_floats_, fp) == feature_floats_;
+  }
+  ok = (fclose(fp) == 0) && ok;
+  if (ok) ok = rename(tmp.c_str(), sidecar.c_str()) == 0;
+  if (!ok) remove(tmp.c_str());
+  return ok;
+}
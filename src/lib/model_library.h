@@ -0,0 +1,78 @@
+#ifndef MODEL_LIBRARY_H
+#define MODEL_LIBRARY_H
+
+// STL
+#include <list>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "utilities.h"
+
+
+/**
+ * An object model preprocessed for pose estimation, i.e., down sampled with
+ * normals estimated and FPFH features computed.
+ */
+struct ObjectModel
+{
+  std::string path;
+  float dsp_th;
+  PointCloudN::Ptr cloud;
+  PointCloudFPFH::Ptr features;
+
+  typedef boost::shared_ptr<const ObjectModel> ConstPtr;
+};
+
+/**
+ * Library of preprocessed object models keyed by (path, dsp_th). Models are kept
+ * in an LRU cache in memory. The preprocessing results are also written to a binary
+ * sidecar file beside the model file, which is memory mapped to skip the preprocessing
+ * when the model is loaded again, e.g., after restarting the node.
+ */
+class ModelLibrary
+{
+public:
+  /// @param capacity Max number of models kept in memory
+  explicit ModelLibrary(size_t capacity = 16);
+
+  /**
+   * Get the preprocessed model, which is loaded or computed on cache miss.
+   * Could be called concurrently.
+   * @param path Path to the .pcd file of the model
+   * @param dsp_th Down sampling size used for the preprocessing
+   * @return Null if the model could not be loaded
+   */
+  ObjectModel::ConstPtr get(const std::string &path, float dsp_th);
+
+  /// Load the models into the cache in advance
+  void preload(const std::vector<std::string> &paths, float dsp_th);
+
+  /// Sidecar file for the model preprocessed with dsp_th
+  static std::string sidecarPath(const std::string &path, float dsp_th);
+
+private:
+  size_t capacity_;
+
+  boost::mutex mutex_;
+  // Most recently used first
+  std::list<ObjectModel::ConstPtr> lru_;
+  std::unordered_map<std::string, std::list<ObjectModel::ConstPtr>::iterator> index_;
+
+  static std::string makeKey(const std::string &path, float dsp_th);
+
+  /// Load the model from the .pcd file and preprocess it
+  static bool compute(const std::string &path, float dsp_th, ObjectModel &model);
+
+  /**
+   * Read the sidecar with mmap, it is only valid if the model file has not been
+   * modified since the sidecar was written.
+   */
+  static bool loadSidecar(const std::string &path, float dsp_th, ObjectModel &model);
+  static bool saveSidecar(const std::string &path, float dsp_th, const ObjectModel &model);
+};
+
+#endif // MODEL_LIBRARY_H
@@ -0,0 +1,215 @@
+#include "occupancy_grid.h"
+
+using namespace std;
+
+// Walking directions of marching squares, in cell corner coordinates
+enum step_dir{NONE, UP, DOWN, LEFT, RIGHT};
+
+OccupancyGrid::OccupancyGrid() :
+  width_(0),
+  height_(0),
+  resolution_(0.01f),
+  origin_x_(0.0f),
+  origin_y_(0.0f),
+  occupied_num_(0)
+{
+}
+
+void OccupancyGrid::fromCloud(const PointCloudMono::Ptr& cloud, float resolution)
+{
+  fromCloud(cloud, resolution, 0, cloud->points.size());
+}
+
+void OccupancyGrid::fromCloud(const PointCloudMono::Ptr& cloud, float resolution, size_t begin, size_t end)
+{
+  clear();
+  resolution_ = resolution;
+
+  float min_x = FLT_MAX, min_y = FLT_MAX;
+  float max_x = -FLT_MAX, max_y = -FLT_MAX;
+  for (size_t i = begin; i < end; ++i) {
+    const pcl::PointXYZ &pt = cloud->points[i];
+    if (!isfinite(pt.x) || !isfinite(pt.y)) continue;
+    if (pt.x < min_x) min_x = pt.x;
+    if (pt.y < min_y) min_y = pt.y;
+    if (pt.x > max_x) max_x = pt.x;
+    if (pt.y > max_y) max_y = pt.y;
+  }
+  if (min_x > max_x) return;
+
+  // Pad one empty cell on each side so that the boundary could always be traced
+  origin_x_ = min_x - resolution_;
+  origin_y_ = min_y - resolution_;
+  width_ = int(floor((max_x - origin_x_) / resolution_)) + 2;
+  height_ = int(floor((max_y - origin_y_) / resolution_)) + 2;
+  cells_.assign(width_ * height_, 0);
+
+  for (size_t i = begin; i < end; ++i) {
+    const pcl::PointXYZ &pt = cloud->points[i];
+    if (!isfinite(pt.x) || !isfinite(pt.y)) continue;
+    int c = int(floor((pt.x - origin_x_) / resolution_));
+    int r = int(floor((pt.y - origin_y_) / resolution_));
+    uint8_t &cell = cells_[r * width_ + c];
+    if (!cell) {
+      cell = 1;
+      occupied_num_++;
+    }
+  }
+}
+
+void OccupancyGrid::clear()
+{
+  occupied_num_ = 0;
+  cells_.clear();
+  width_ = 0;
+  height_ = 0;
+}
+
+void OccupancyGrid::dilate(vector<uint8_t> &cells_out, bool erode) const
+{
+  // Erosion is the dilation of empty cells
+  uint8_t hit = erode ? 0 : 1;
+  cells_out.assign(cells_.size(), 1 - hit);
+  for (int r = 0; r < height_; ++r) {
+    for (int c = 0; c < width_; ++c) {
+      bool found = false;
+      for (int dr = -1; dr <= 1 && !found; ++dr) {
+        for (int dc = -1; dc <= 1; ++dc) {
+          int nc = c + dc;
+          int nr = r + dr;
+          // Cells out of the grid are considered empty
+          uint8_t v = (nc < 0 || nr < 0 || nc >= width_ || nr >= height_) ? 0 : cells_[nr * width_ + nc];
+          if ((v != 0) == (hit != 0)) {
+            found = true;
+            break;
+          }
+        }
+      }
+      if (found) cells_out[r * width_ + c] = hit;
+    }
+  }
+}
+
+void OccupancyGrid::close()
+{
+  if (cells_.empty()) return;
+  vector<uint8_t> temp;
+  dilate(temp, false);
+  cells_.swap(temp);
+  dilate(temp, true);
+  cells_.swap(temp);
+
+  occupied_num_ = 0;
+  for (uint8_t cell : cells_) {
+    if (cell) occupied_num_++;
+  }
+}
+
+void OccupancyGrid::keepLargestComponent()
+{
+  if (occupied_num_ == 0) return;
+
+  vector<int> labels(cells_.size(), -1);
+  vector<int> queue;
+  queue.reserve(occupied_num_);
+
+  int label = 0;
+  int best_label = -1;
+  size_t best_size = 0;
+  for (size_t i = 0; i < cells_.size(); ++i) {
+    if (!cells_[i] || labels[i] >= 0) continue;
+
+    // Breadth first search with 8-neighbours
+    queue.clear();
+    queue.push_back(int(i));
+    labels[i] = label;
+    for (size_t q = 0; q < queue.size(); ++q) {
+      int c = queue[q] % width_;
+      int r = queue[q] / width_;
+      for (int dr = -1; dr <= 1; ++dr) {
+        for (int dc = -1; dc <= 1; ++dc) {
+          if (!isOccupied(c + dc, r + dr)) continue;
+          int n = (r + dr) * width_ + c + dc;
+          if (labels[n] >= 0) continue;
+          labels[n] = label;
+          queue.push_back(n);
+        }
+      }
+    }
+    if (queue.size() > best_size) {
+      best_size = queue.size();
+      best_label = label;
+    }
+    label++;
+  }
+
+  for (size_t i = 0; i < cells_.size(); ++i) {
+    if (labels[i] != best_label) cells_[i] = 0;
+  }
+  occupied_num_ = best_size;
+}
+
+void OccupancyGrid::traceContour(PointCloudMono::Ptr &contour, float z, bool concave) const
+{
+  contour->clear();
+  if (occupied_num_ == 0) return;
+
+  // The first occupied cell in raster order must be on the outer boundary, and its
+  // top left corner only has the bottom right cell occupied
+  int start = 0;
+  while (!cells_[start]) start++;
+  int start_x = start % width_;
+  int start_y = start / width_;
+
+  vector<cv::Point2f> vertices;
+  int x = start_x;
+  int y = start_y;
+  step_dir prev = NONE;
+  // Each corner of the grid could be passed at most twice
+  size_t max_steps = 2 * size_t(width_ + 1) * size_t(height_ + 1);
+  for (size_t s = 0; s < max_steps; ++s) {
+    // Corner (x, y) is surrounded by cells (x-1, y-1), (x, y-1), (x-1, y), (x, y)
+    int state = (isOccupied(x - 1, y - 1) ? 1 : 0) | (isOccupied(x, y - 1) ? 2 : 0) |
+                (isOccupied(x - 1, y) ? 4 : 0) | (isOccupied(x, y) ? 8 : 0);
+
+    // The occupied cells are always kept on the left side of the walking direction
+    step_dir next;
+    switch (state) {
+      case 1: case 5: case 13: next = UP; break;
+      case 2: case 3: case 7: next = RIGHT; break;
+      case 4: case 12: case 14: next = LEFT; break;
+      case 8: case 10: case 11: next = DOWN; break;
+      // Saddles, follow the diagonal so that 8-connected cells are in one contour
+      case 6: next = (prev == UP) ? RIGHT : LEFT; break;
+      case 9: next = (prev == RIGHT) ? DOWN : UP; break;
+      default: next = NONE; break;
+    }
+    if (next == NONE) break;
+
+    if (next != prev) {
+      vertices.emplace_back(origin_x_ + x * resolution_, origin_y_ + y * resolution_);
+    }
+    prev = next;
+
+    if (next == UP) y--;
+    else if (next == DOWN) y++;
+    else if (next == LEFT) x--;
+    else x++;
+
+    if (x == start_x && y == start_y) break;
+  }
+
+  if (!concave && vertices.size() > 3) {
+    vector<cv::Point2f> hull;
+    cv::convexHull(vertices, hull);
+    vertices.swap(hull);
+  }
+
+  contour->points.reserve(vertices.size());
+  for (const auto & v : vertices) {
+    contour->points.emplace_back(v.x, v.y, z);
+  }
+  contour->width = contour->points.size();
+  contour->height = 1;
+  contour->is_dense = true;
+}
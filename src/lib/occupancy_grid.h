@@ -0,0 +1,87 @@
+#ifndef OCCUPANCY_GRID_H
+#define OCCUPANCY_GRID_H
+
+// STL
+#include <vector>
+#include <cstdint>
+
+#include "utilities.h"
+
+
+/**
+ * Dense 2D grid in the X-Y plane, each cell is a square with edge length of resolution_.
+ * A horizontal plane rasterized into this grid can be traced into an ordered (and
+ * optionally concave) contour in linear time, which avoids computing the hull with qhull.
+ */
+class OccupancyGrid
+{
+public:
+  OccupancyGrid();
+
+  /**
+   * Rasterize the XY coordinates of the given cloud into the grid. The grid covers the
+   * bounding rect of the cloud with one empty cell padded on each side.
+   * @param cloud Point cloud, z values are ignored
+   * @param resolution Edge length of a cell in meter, typically th_grid_rsl_
+   */
+  void fromCloud(const PointCloudMono::Ptr& cloud, float resolution);
+
+  /// Only rasterize the points in range [begin, end) of the cloud
+  void fromCloud(const PointCloudMono::Ptr& cloud, float resolution, size_t begin, size_t end);
+
+  /// Remove all cells, the allocated memory is kept
+  void clear();
+
+  /// Morphological closing (dilate then erode) with 3x3 kernel to fill single cell gaps
+  void close();
+
+  /// Only keep the largest 8-connected component of occupied cells
+  void keepLargestComponent();
+
+  /**
+   * Trace the outer boundary of the occupied cells with marching squares. Diagonally
+   * adjacent cells are treated as connected. Only the vertices where the boundary turns
+   * are kept, so the contour is ordered and all its edges are aligned with the grid.
+   * @param contour Output contour, empty if no cell is occupied
+   * @param z The z value assigned to all contour vertices
+   * @param concave If false, output the convex hull of the traced boundary instead
+   */
+  void traceContour(PointCloudMono::Ptr &contour, float z, bool concave = true) const;
+
+  inline bool isOccupied(int c, int r) const
+  {
+    if (c < 0 || r < 0 || c >= width_ || r >= height_) return false;
+    return cells_[r * width_ + c] != 0;
+  }
+
+  inline bool isOccupied(float x, float y) const
+  {
+    return isOccupied(int(floor((x - origin_x_) / resolution_)),
+                      int(floor((y - origin_y_) / resolution_)));
+  }
+
+  /// Index of the cell containing point (x, y) in cells_, -1 if out of the grid
+  inline int cellIndex(float x, float y) const
+  {
+    int c = int(floor((x - origin_x_) / resolution_));
+    int r = int(floor((y - origin_y_) / resolution_));
+    if (c < 0 || r < 0 || c >= width_ || r >= height_) return -1;
+    return r * width_ + c;
+  }
+
+  inline bool empty() const { return occupied_num_ == 0; }
+
+  int width_;
+  int height_;
+  float resolution_;
+  // Position of the corner of cell (0, 0) in XY plane
+  float origin_x_;
+  float origin_y_;
+  size_t occupied_num_;
+  std::vector<uint8_t> cells_;
+
+private:
+  void dilate(std::vector<uint8_t> &cells_out, bool erode) const;
+};
+
+#endif // OCCUPANCY_GRID_H
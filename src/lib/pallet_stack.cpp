@@ -0,0 +1,130 @@
+#include "pallet_stack.h"
+
+#include <algorithm>
+
+using namespace std;
+
+/// Parameters of the stack verification, ratios of the points in a footprint or a layer
+float th_present_ratio_ = 0.7; // A box is kept if at least this ratio is at its height
+float th_removed_ratio_ = 0.1; // A box is picked if at most this ratio is at its height
+float th_layer_ratio_ = 0.6; // The exposed layer should have at least this ratio in one z band
+
+PalletStack::PalletStack(float th_z, float resolution, size_t min_points) :
+  th_z_(th_z),
+  resolution_(resolution),
+  min_points_(min_points),
+  min_x_(FLT_MAX),
+  min_y_(FLT_MAX),
+  max_x_(-FLT_MAX),
+  max_y_(-FLT_MAX)
+{
+}
+
+void PalletStack::clear()
+{
+  boxes_.clear();
+  masks_.clear();
+  layer_heights_.clear();
+  min_x_ = FLT_MAX;
+  min_y_ = FLT_MAX;
+  max_x_ = -FLT_MAX;
+  max_y_ = -FLT_MAX;
+}
+
+void PalletStack::reset(const vector<StackBox> &boxes)
+{
+  clear();
+  for (const auto & box : boxes) {
+    if (!box.footprint || box.footprint->points.size() < 3) continue;
+    boxes_.push_back(box);
+    masks_.emplace_back();
+    masks_.back().build(box.footprint, resolution_);
+    for (const auto & pt : box.footprint->points) {
+      min_x_ = min(min_x_, pt.x);
+      min_y_ = min(min_y_, pt.y);
+      max_x_ = max(max_x_, pt.x);
+      max_y_ = max(max_y_, pt.y);
+    }
+    addLayerHeight(float(box.pose.position.z));
+  }
+}
+
+void PalletStack::addLayerHeight(float z)
+{
+  for (float h : layer_heights_) {
+    if (fabs(h - z) <= th_z_) return;
+  }
+  layer_heights_.push_back(z);
+  sort(layer_heights_.begin(), layer_heights_.end(), greater<float>());
+}
+
+bool PalletStack::verify(const PointCloudMono::Ptr &cloud)
+{
+  if (boxes_.empty()) return false;
+
+  size_t num = boxes_.size();
+  vector<size_t> total(num, 0);
+  vector<size_t> at_top(num, 0);
+  vector<size_t> above(num, 0);
+  vector<vector<float> > below(num);
+
+  // Only the points in the footprints are visited, the footprints do not overlap
+  for (const auto & pt : cloud->points) {
+    if (!(pt.x >= min_x_ && pt.x <= max_x_ && pt.y >= min_y_ && pt.y <= max_y_)) continue;
+    if (!(pt.z == pt.z)) continue;
+    for (size_t b = 0; b < num; ++b) {
+      if (!masks_[b].isInside(pt.x, pt.y)) continue;
+      total[b]++;
+      float dz = pt.z - float(boxes_[b].pose.position.z);
+      if (fabs(dz) <= th_z_) at_top[b]++;
+      else if (dz > th_z_) above[b]++;
+      else below[b].push_back(pt.z);
+      break;
+    }
+  }
+
+  vector<StackBox> kept;
+  vector<ContourMask> kept_masks;
+  for (size_t b = 0; b < num; ++b) {
+    // Occluded or out of view, or something is put on it
+    if (total[b] < min_points_ || above[b] > th_removed_ratio_ * total[b]) {
+      clear();
+      return false;
+    }
+
+    float top_ratio = float(at_top[b]) / total[b];
+    if (top_ratio >= th_present_ratio_) {
+      kept.push_back(boxes_[b]);
+      kept_masks.push_back(masks_[b]);
+      continue;
+    }
+    if (top_ratio > th_removed_ratio_) {
+      // Partially moved
+      clear();
+      return false;
+    }
+
+    // The box is picked, the exposed points should be on one lower layer
+    vector<float> &zs = below[b];
+    nth_element(zs.begin(), zs.begin() + zs.size() / 2, zs.end());
+    float z_mid = zs[zs.size() / 2];
+    size_t in_band = 0;
+    for (float z : zs) {
+      if (fabs(z - z_mid) <= th_z_) in_band++;
+    }
+    if (in_band < th_layer_ratio_ * zs.size()) {
+      clear();
+      return false;
+    }
+    addLayerHeight(z_mid);
+  }
+
+  if (kept.empty()) {
+    // The top layer is cleared, the new layer needs a full extraction
+    clear();
+    return false;
+  }
+  boxes_.swap(kept);
+  masks_.swap(kept_masks);
+  return true;
+}
@@ -0,0 +1,79 @@
+#ifndef PALLET_STACK_H
+#define PALLET_STACK_H
+
+// STL
+#include <vector>
+
+#include <geometry_msgs/Pose.h>
+
+#include "utilities.h"
+#include "contour_mask.h"
+
+
+/**
+ * A box top detected on the top layer of the pallet stack.
+ */
+struct StackBox
+{
+  geometry_msgs::Pose pose;
+  int category;
+  float confidence;
+  // Corners of the rotated rect of the box top in base frame, z values are ignored
+  PointCloudMono::Ptr footprint;
+};
+
+/**
+ * Model of the pallet stack kept between requests. It remembers the box tops on the
+ * top layer and the heights of the layers seen. With a new cloud only the footprints
+ * of the remembered boxes are checked: a box is kept if its footprint is still occupied
+ * at its height, and is taken as picked if the footprint now shows a lower layer. Any
+ * other observation makes the model inconsistent and a full extraction is needed.
+ */
+class PalletStack
+{
+public:
+  /**
+   * @param th_z Points within this distance in z to a box top belong to it
+   * @param resolution Cell size of the footprint masks in meter
+   * @param min_points Min number of points in a footprint to verify the box
+   */
+  PalletStack(float th_z, float resolution, size_t min_points = 20);
+
+  /// Replace the model with the boxes of a full extraction
+  void reset(const std::vector<StackBox> &boxes);
+
+  void clear();
+
+  inline bool empty() const { return boxes_.empty(); }
+
+  /**
+   * Verify the remembered boxes with a new cloud in base frame and remove the picked
+   * ones. The model is cleared if the result is inconsistent or no box is left.
+   * @return True if the model is consistent with the cloud and some boxes are left
+   */
+  bool verify(const PointCloudMono::Ptr &cloud);
+
+  inline const std::vector<StackBox> &boxes() const { return boxes_; }
+
+  /// Heights of the layers seen since last reset, in descending order
+  inline const std::vector<float> &layerHeights() const { return layer_heights_; }
+
+private:
+  float th_z_;
+  float resolution_;
+  size_t min_points_;
+
+  std::vector<StackBox> boxes_;
+  std::vector<ContourMask> masks_;
+  std::vector<float> layer_heights_;
+
+  // XY extent of all footprints
+  float min_x_;
+  float min_y_;
+  float max_x_;
+  float max_y_;
+
+  void addLayerHeight(float z);
+};
+
+#endif // PALLET_STACK_H
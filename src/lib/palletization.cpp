@@ -4,9 +4,50 @@
 
 #include "palletization.h"
 
+/// Min area in m^2 of a z cluster to be taken as the top layer, smaller ones above the
+/// boxes are usually noise or debris
+float th_min_top_area_ = 0.01; // About a 10 cm x 10 cm box top
+
+
+PalletContext::PalletContext() :
+  src_mono_cloud(new PointCloudMono),
+  src_dsp_mono(new PointCloudMono),
+  src_normals(new CloudN),
+  idx_norm_fit(new pcl::PointIndices),
+  cloud_norm_fit_mono(new PointCloudMono),
+  max_plane_cloud(new PointCloudMono),
+  max_plane_z(0),
+  max_plane_points_num(0)
+{
+}
+
+void PalletContext::reset()
+{
+  origin_heights.clear();
+  src_mono_cloud->clear();
+  src_dsp_mono->clear();
+  src_normals->clear();
+  idx_norm_fit->indices.clear();
+  cloud_norm_fit_mono->clear();
+  for (auto & band : band_clouds) {
+    band->clear();
+  }
+  plane_z_values.clear();
+  seed_clusters_indices.clear();
+  box_poses.clear();
+  box_categories.clear();
+  box_confidences.clear();
+  box_footprints.clear();
+
+  // The max plane may be shared with the cloud of a plane, so it is replaced
+  max_plane_cloud.reset(new PointCloudMono);
+  max_plane_z = 0;
+  max_plane_points_num = 0;
+}
 
 Palletization::Palletization(ros::NodeHandle nh, string base_frame, float th_xy, float th_z)
-    : nh_(nh), base_frame_(base_frame), th_grid_rsl_(th_xy), th_z_rsl_(th_z), tf_(new Transform)
+    : nh_(nh), base_frame_(base_frame), th_grid_rsl_(th_xy), th_z_rsl_(th_z), tf_(new Transform),
+      stack_(th_z, th_xy)
 {
   get_object_pose_server_ = nh_.advertiseService("get_object_info", &Palletization::getObjectInfoCb, this);
   object_pose_puber_ = nh_.advertise<geometry_msgs::PoseArray>("object_poses", 1, true);
@@ -15,109 +56,369 @@ Palletization::Palletization(ros::NodeHandle nh, string base_frame, float th_xy,
   th_norm_ = sqrt(1 / (1 + 2 * pow(th_theta_, 2)));
 }
 
+Palletization::~Palletization()
+{
+  for (PalletContext *ctx : all_contexts_) {
+    delete ctx;
+  }
+  delete tf_;
+}
+
+PalletContext *Palletization::acquireContext()
+{
+  boost::mutex::scoped_lock lock(pool_mutex_);
+  if (free_contexts_.empty()) {
+    all_contexts_.push_back(new PalletContext);
+    return all_contexts_.back();
+  }
+  PalletContext *ctx = free_contexts_.back();
+  free_contexts_.pop_back();
+  return ctx;
+}
+
+void Palletization::releaseContext(PalletContext *ctx)
+{
+  boost::mutex::scoped_lock lock(pool_mutex_);
+  free_contexts_.push_back(ctx);
+}
+
 bool Palletization::getObjectInfoCb(hope::GetObjectPose::Request &req,
                                     hope::GetObjectPose::Response &res) {
-  origin_heights_ = req.origin_heights;
+  // Everything changed during processing lives in the context, so concurrent
+  // requests from the AsyncSpinner threads do not interfere
+  PalletContext *ctx = acquireContext();
+  ctx->reset();
+
+  int category;
+  geometry_msgs::Pose pose;
+  bool ok = false;
+  try {
+    ok = process(*ctx, req, category, pose);
+  } catch (...) {
+    releaseContext(ctx);
+    throw;
+  }
+
+  if (ok) {
+    res.pose = pose;
+    res.category = category;
+    res.poses = ctx->box_poses;
+    res.categories = ctx->box_categories;
+    res.confidences = ctx->box_confidences;
+    res.result_status = res.SUCCEEDED;
+  } else {
+    res.result_status = res.FAILED;
+  }
+  releaseContext(ctx);
+  return true;
+}
+
+bool Palletization::process(PalletContext &ctx, const hope::GetObjectPose::Request &req,
+                            int& category, geometry_msgs::Pose& pose)
+{
+  ctx.origin_heights = req.origin_heights;
   PointCloudMono::Ptr src_cloud(new PointCloudMono);
   pcl::fromROSMsg(req.points, *src_cloud);
 
   if (!Utilities::isPointCloudValid(src_cloud)) {
     ROS_ERROR("HoPE: Source cloud is empty.");
-    res.result_status = res.FAILED;
-    return true;
+    return false;
   }
 
-  reset();
+  // The looked up transform is kept by the caller instead of in tf_
+  geometry_msgs::TransformStamped tf_handle;
+  if (!tf_->getTransform(base_frame_, req.points.header.frame_id, tf_handle)) return false;
+  Transform::doTransform(src_cloud, ctx.src_mono_cloud, tf_handle);
 
-  if (!tf_->getTransform(base_frame_, req.points.header.frame_id)) return false;
-  tf_->doTransform(src_cloud, src_mono_cloud_);
+  if (req.use_stack_model && verifyStackModel(ctx)) {
+    pose = ctx.box_poses[0];
+    category = ctx.box_categories[0];
+    return true;
+  }
 
-  Utilities::downSampling(src_mono_cloud_, src_dsp_mono_, th_grid_rsl_, th_z_rsl_);
-  if (!Utilities::isPointCloudValid(src_dsp_mono_)) {
+  if (req.known_heights) {
+    return processKnownHeights(ctx, category, pose);
+  }
+
+  Utilities::downSampling(ctx.src_mono_cloud, ctx.src_dsp_mono, th_grid_rsl_, th_z_rsl_);
+  if (!Utilities::isPointCloudValid(ctx.src_dsp_mono)) {
     ROS_ERROR("HoPE: Down sampled source cloud is empty.");
-    res.result_status = res.FAILED;
-    return true;
+    return false;
   }
 
-  computeNormalAndFilter();
-  zClustering(cloud_norm_fit_mono_); // -> seed_clusters_indices_
-  if (seed_clusters_indices_.empty()) {
+  computeNormalAndFilter(ctx);
+  zClustering(ctx); // -> seed_clusters_indices
+  if (ctx.seed_clusters_indices.empty()) {
     ROS_ERROR("HoPE: Z growing got nothing.");
-    res.result_status = res.FAILED;
+    return false;
+  }
+
+  if (req.all_boxes || req.use_stack_model) {
+    if (!getTopLayerBoxes(ctx)) return false;
+    if (req.use_stack_model) resetStackModel(ctx);
+    pose = ctx.box_poses[0];
+    category = ctx.box_categories[0];
     return true;
   }
 
-  plane_z_values_.clear();
-  plane_z_values_.insert(plane_z_values_.end(), req.origin_heights.begin(), req.origin_heights.end());
-  extractPlaneForEachZ(cloud_norm_fit_mono_);
+  ctx.plane_z_values.insert(ctx.plane_z_values.end(), req.origin_heights.begin(), req.origin_heights.end());
+  extractPlaneForEachZ(ctx);
 
-  int category;
-  geometry_msgs::Pose pose;
-  if (postProcessing(category, pose)) {
-    res.pose = pose;
-    res.category = category;
-    res.result_status = res.SUCCEEDED;
-  } else {
-    res.result_status = res.FAILED;
+  return postProcessing(ctx, category, pose);
+}
+
+bool Palletization::processKnownHeights(PalletContext &ctx, int& category, geometry_msgs::Pose& pose)
+{
+  const vector<double> &heights = ctx.origin_heights;
+  if (heights.empty()) {
+    ROS_ERROR("HoPE: No known height given.");
+    return false;
+  }
+
+  while (ctx.band_clouds.size() < heights.size()) {
+    ctx.band_clouds.push_back(PointCloudMono::Ptr(new PointCloudMono));
   }
 
+  // Assign each point to the band of the closest height, NaN points fail the test
+  for (const auto & pt : ctx.src_mono_cloud->points) {
+    int best = -1;
+    float best_dis = th_z_rsl_;
+    for (size_t h = 0; h < heights.size(); ++h) {
+      float dis = fabs(pt.z - float(heights[h]));
+      if (dis <= best_dis) {
+        best_dis = dis;
+        best = int(h);
+      }
+    }
+    if (best >= 0) ctx.band_clouds[best]->points.push_back(pt);
+  }
+
+  // Keep the largest connected patch in each band and select the largest one by area
+  size_t best_cells = 0;
+  for (size_t h = 0; h < heights.size(); ++h) {
+    PointCloudMono::Ptr &band = ctx.band_clouds[h];
+    if (band->points.size() <= 4) continue;
+    band->width = band->points.size();
+    band->height = 1;
+
+    ctx.grid.fromCloud(band, th_grid_rsl_);
+    ctx.grid.keepLargestComponent();
+    if (ctx.grid.occupied_num_ <= best_cells) continue;
+    best_cells = ctx.grid.occupied_num_;
+
+    PointCloudMono::Ptr patch(new PointCloudMono);
+    patch->points.reserve(band->points.size());
+    for (const auto & pt : band->points) {
+      int id = ctx.grid.cellIndex(pt.x, pt.y);
+      if (id >= 0 && ctx.grid.cells_[id]) patch->points.push_back(pt);
+    }
+    patch->width = patch->points.size();
+    patch->height = 1;
+    ctx.max_plane_cloud = patch;
+    ctx.max_plane_z = float(heights[h]);
+    ctx.max_plane_points_num = patch->points.size();
+  }
+
+  if (best_cells == 0) {
+    ROS_WARN("HoPE: No box top found at the known heights.");
+    return false;
+  }
+  return postProcessing(ctx, category, pose);
+}
+
+bool Palletization::getTopLayerBoxes(PalletContext &ctx)
+{
+  // Mean z of each z cluster, too small ones are ignored as noise
+  const size_t min_points = 5;
+  vector<float> z_means(ctx.seed_clusters_indices.size(), -FLT_MAX);
+  float z_top = -FLT_MAX;
+  for (size_t i = 0; i < ctx.seed_clusters_indices.size(); ++i) {
+    const vector<int> &indices = ctx.seed_clusters_indices[i].indices;
+    if (indices.size() < min_points) continue;
+    float z_sum = 0;
+    for (int id : indices) {
+      z_sum += ctx.cloud_norm_fit_mono->points[id].z;
+    }
+    z_means[i] = z_sum / indices.size();
+    if (z_means[i] <= z_top) continue;
+
+    // Only a cluster as large as a box top could be the reference of the layer
+    pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
+    idx_seed->indices = indices;
+    PointCloudMono::Ptr cloud_z(new PointCloudMono);
+    Utilities::getCloudByInliers(ctx.cloud_norm_fit_mono, cloud_z, idx_seed, false, false);
+    ctx.grid.fromCloud(cloud_z, th_grid_rsl_);
+    if (ctx.grid.occupied_num_ * th_grid_rsl_ * th_grid_rsl_ < th_min_top_area_) continue;
+    z_top = z_means[i];
+  }
+  if (z_top == -FLT_MAX) {
+    ROS_WARN("HoPE: No valid z cluster for the top layer.");
+    return false;
+  }
+
+  vector<pair<float, size_t> > order;
+  for (size_t i = 0; i < ctx.seed_clusters_indices.size(); ++i) {
+    if (z_top - z_means[i] > th_z_rsl_) continue;
+
+    pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
+    idx_seed->indices = ctx.seed_clusters_indices[i].indices;
+    PointCloudMono::Ptr cloud_z(new PointCloudMono);
+    Utilities::getCloudByInliers(ctx.cloud_norm_fit_mono, cloud_z, idx_seed, false, false);
+
+    // Boxes at the same height are separated by the gaps between them
+    vector<pcl::PointIndices> boxes_indices;
+    Utilities::extractClusters(cloud_z, boxes_indices, 1.5f * th_grid_rsl_, int(min_points), INT_MAX);
+    for (auto & box_indices : boxes_indices) {
+      pcl::PointIndices::Ptr idx_box(new pcl::PointIndices(box_indices));
+      PointCloudMono::Ptr box_cloud(new PointCloudMono);
+      Utilities::getCloudByInliers(cloud_z, box_cloud, idx_box, false, false);
+
+      geometry_msgs::Pose pose;
+      int category;
+      try {
+        if (!Utilities::getBoxTopPose(box_cloud, pose, category, ctx.origin_heights)) continue;
+      } catch (cv::Exception) {
+        ROS_WARN("HoPE: Exception raised during getting box pose");
+        continue;
+      }
+      PointCloudMono::Ptr footprint(new PointCloudMono);
+      order.emplace_back(getFillRatio(ctx, box_cloud, footprint), ctx.box_poses.size());
+      ctx.box_poses.push_back(pose);
+      ctx.box_categories.push_back(category);
+      ctx.box_footprints.push_back(footprint);
+    }
+  }
+  if (order.empty()) {
+    ROS_WARN("HoPE: Get box top pose failed for the top layer");
+    return false;
+  }
+
+  // Sort by descending confidence
+  sort(order.begin(), order.end(), [](const pair<float, size_t> &a, const pair<float, size_t> &b) {
+    return a.first > b.first;
+  });
+  vector<geometry_msgs::Pose> poses;
+  vector<int> categories;
+  vector<PointCloudMono::Ptr> footprints;
+  for (const auto & o : order) {
+    poses.push_back(ctx.box_poses[o.second]);
+    categories.push_back(ctx.box_categories[o.second]);
+    footprints.push_back(ctx.box_footprints[o.second]);
+    ctx.box_confidences.push_back(o.first);
+  }
+  ctx.box_poses.swap(poses);
+  ctx.box_categories.swap(categories);
+  ctx.box_footprints.swap(footprints);
+
+  geometry_msgs::PoseArray object_poses;
+  object_poses.header.stamp = ros::Time::now();
+  object_poses.header.frame_id = base_frame_;
+  object_poses.poses = ctx.box_poses;
+  object_pose_puber_.publish(object_poses);
   return true;
 }
 
-void Palletization::reset()
+float Palletization::getFillRatio(PalletContext &ctx, const PointCloudMono::Ptr &patch,
+                                  PointCloudMono::Ptr &footprint)
+{
+  vector<pcl::PointXY> rect;
+  pcl::PointXY center{};
+  pcl::PointXY edge_center{};
+  float width, height, rotation;
+  Utilities::getRotatedRect2D(patch, rect, center, edge_center, width, height, rotation);
+  footprint->clear();
+  for (const auto & corner : rect) {
+    footprint->points.emplace_back(corner.x, corner.y, 0.0f);
+  }
+  footprint->width = footprint->points.size();
+  footprint->height = 1;
+  float rect_area = width * height;
+  if (rect_area <= 0) return 0;
+
+  // The down sampled points are about one per cell, so the occupied cells give the covered area
+  ctx.grid.fromCloud(patch, th_grid_rsl_);
+  float covered = ctx.grid.occupied_num_ * th_grid_rsl_ * th_grid_rsl_;
+  return min(1.0f, covered / rect_area);
+}
+
+bool Palletization::verifyStackModel(PalletContext &ctx)
 {
-  src_mono_cloud_.reset(new PointCloudMono);
-  src_dsp_mono_.reset(new PointCloudMono);
-  cloud_norm_fit_mono_.reset(new PointCloudMono);
-  max_plane_cloud_.reset(new PointCloudMono);
-  src_normals_.reset(new CloudN);
-  idx_norm_fit_.reset(new pcl::PointIndices);
+  boost::mutex::scoped_lock lock(stack_mutex_);
+  if (stack_.empty()) return false;
+  if (!stack_.verify(ctx.src_mono_cloud)) {
+    ROS_INFO("HoPE: Stack model is inconsistent with the scene, run full extraction.");
+    return false;
+  }
 
-  plane_z_values_.clear();
-  seed_clusters_indices_.clear();
+  // The boxes keep the order of descending confidence
+  for (const auto & box : stack_.boxes()) {
+    ctx.box_poses.push_back(box.pose);
+    ctx.box_categories.push_back(box.category);
+    ctx.box_confidences.push_back(box.confidence);
+  }
 
-  max_plane_points_num_ = 0;
+  geometry_msgs::PoseArray object_poses;
+  object_poses.header.stamp = ros::Time::now();
+  object_poses.header.frame_id = base_frame_;
+  object_poses.poses = ctx.box_poses;
+  object_pose_puber_.publish(object_poses);
+  return true;
+}
+
+void Palletization::resetStackModel(const PalletContext &ctx)
+{
+  vector<StackBox> boxes(ctx.box_poses.size());
+  for (size_t i = 0; i < boxes.size(); ++i) {
+    boxes[i].pose = ctx.box_poses[i];
+    boxes[i].category = ctx.box_categories[i];
+    boxes[i].confidence = ctx.box_confidences[i];
+    boxes[i].footprint = ctx.box_footprints[i];
+  }
+  boost::mutex::scoped_lock lock(stack_mutex_);
+  stack_.reset(boxes);
 }
 
-void Palletization::computeNormalAndFilter()
+void Palletization::computeNormalAndFilter(PalletContext &ctx)
 {
-  Utilities::estimateNorm(src_dsp_mono_, src_normals_, 1.01 * th_grid_rsl_);
-  Utilities::getCloudByNorm(src_normals_, idx_norm_fit_, th_norm_);
-  if (idx_norm_fit_->indices.empty()) {
+  Utilities::estimateNorm(ctx.src_dsp_mono, ctx.src_normals, 1.01 * th_grid_rsl_);
+  Utilities::getCloudByNorm(ctx.src_normals, ctx.idx_norm_fit, th_norm_);
+  if (ctx.idx_norm_fit->indices.empty()) {
     ROS_WARN("HoPE: No point fits the normal criteria");
     return;
   }
-  Utilities::getCloudByInliers(src_dsp_mono_, cloud_norm_fit_mono_, idx_norm_fit_, false, false);
+  Utilities::getCloudByInliers(ctx.src_dsp_mono, ctx.cloud_norm_fit_mono, ctx.idx_norm_fit, false, false);
 }
 
-void Palletization::extractPlaneForEachZ(PointCloudMono::Ptr cloud_norm_fit)
+void Palletization::extractPlaneForEachZ(PalletContext &ctx)
 {
   size_t id = 0;
-  for (float & plane_z_value : plane_z_values_) {
-    getPlane(id, plane_z_value, cloud_norm_fit);
+  for (float & plane_z_value : ctx.plane_z_values) {
+    // There may be less clusters than given heights
+    if (id >= ctx.seed_clusters_indices.size()) break;
+    getPlane(ctx, id, plane_z_value);
     id++;
   }
 }
 
-void Palletization::getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono)
+void Palletization::getPlane(PalletContext &ctx, size_t id, float z_in)
 {
   pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
-  idx_seed->indices = seed_clusters_indices_[id].indices;
+  idx_seed->indices = ctx.seed_clusters_indices[id].indices;
 
   // Extract the plane points indexed by idx_seed
   PointCloudMono::Ptr cloud_z(new PointCloudMono);
-  Utilities::getCloudByInliers(cloud_norm_fit_mono, cloud_z, idx_seed, false, false);
+  Utilities::getCloudByInliers(ctx.cloud_norm_fit_mono, cloud_z, idx_seed, false, false);
 
   // Update the data of the max plane detected
-  if (cloud_z->points.size() > max_plane_points_num_) {
-    max_plane_cloud_ = cloud_z;
+  if (cloud_z->points.size() > ctx.max_plane_points_num) {
+    ctx.max_plane_cloud = cloud_z;
     // Use convex hull to represent the plane patch
-    max_plane_z_ = z_in;
-    max_plane_points_num_ = cloud_z->points.size();
+    ctx.max_plane_z = z_in;
+    ctx.max_plane_points_num = cloud_z->points.size();
   }
 }
 
-void Palletization::zClustering(const PointCloudMono::Ptr& cloud_norm_fit_mono)
+void Palletization::zClustering(PalletContext &ctx)
 {
   ZGrowing zg;
   pcl::search::Search<pcl::PointXYZ>::Ptr tree = boost::shared_ptr<pcl::search::Search<pcl::PointXYZ> >
@@ -127,16 +428,16 @@ void Palletization::zClustering(const PointCloudMono::Ptr& cloud_norm_fit_mono)
   zg.setMaxClusterSize(INT_MAX);
   zg.setSearchMethod(tree);
   zg.setNumberOfNeighbours(8);
-  zg.setInputCloud(cloud_norm_fit_mono);
+  zg.setInputCloud(ctx.cloud_norm_fit_mono);
   zg.setZThreshold(th_z_rsl_);
 
-  zg.extract(seed_clusters_indices_);
+  zg.extract(ctx.seed_clusters_indices);
 }
 
-bool Palletization::postProcessing(int& category, geometry_msgs::Pose& pose) {
-  if (Utilities::isPointCloudValid(max_plane_cloud_)) {
+bool Palletization::postProcessing(PalletContext &ctx, int& category, geometry_msgs::Pose& pose) {
+  if (Utilities::isPointCloudValid(ctx.max_plane_cloud)) {
     try {
-      bool ok = Utilities::getBoxTopPose(max_plane_cloud_, pose, category, origin_heights_);
+      bool ok = Utilities::getBoxTopPose(ctx.max_plane_cloud, pose, category, ctx.origin_heights);
       if (ok) {
         // Extracted objects' pose
         geometry_msgs::PoseArray object_poses;
@@ -157,4 +458,4 @@ bool Palletization::postProcessing(int& category, geometry_msgs::Pose& pose) {
     ROS_WARN("HoPE: Max plane not valid");
     return false;
   }
-}
\ No newline at end of file
+}
@@ -73,6 +73,7 @@
 
 #include <pcl/visualization/pcl_visualizer.h>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 // STL
 #include <math.h>
@@ -89,34 +90,74 @@
 #include "transform.h"
 #include "utilities.h"
 #include "pose_estimation.h"
+#include "occupancy_grid.h"
+#include "pallet_stack.h"
 
 
+/**
+ * Processing state of one get_object_info request. Contexts are kept in a pool by
+ * Palletization and reused, so that concurrent requests never share buffers while
+ * the buffers of finished requests are not reallocated.
+ */
+struct PalletContext
+{
+  PalletContext();
+
+  /// Clear the content for a new request, the allocated memory is kept
+  void reset();
+
+  // The height of the object origin w.r.t. the base. This origin may not coincide
+  // with the mass centroid of the object, only used to infer its pose or ease
+  // the manipulation as it should be fixed with the object body.
+  std::vector<double> origin_heights;
+
+  // Source point cloud in the base frame
+  PointCloudMono::Ptr src_mono_cloud;
+
+  // Source cloud after down sampling
+  PointCloudMono::Ptr src_dsp_mono;
+
+  // Normals of down sampling cloud
+  CloudN::Ptr src_normals;
+
+  // Normal filtered cloud index and corresponding cloud
+  pcl::PointIndices::Ptr idx_norm_fit;
+  PointCloudMono::Ptr cloud_norm_fit_mono;
+
+  // Clustered points
+  vector<float> plane_z_values;
+  vector<pcl::PointIndices> seed_clusters_indices;
+
+  // Points near each known height and the grid for their xy connectivity
+  vector<PointCloudMono::Ptr> band_clouds;
+  OccupancyGrid grid;
+
+  // Box tops on the top layer, only used when all boxes are requested
+  vector<geometry_msgs::Pose> box_poses;
+  vector<int> box_categories;
+  vector<float> box_confidences;
+  vector<PointCloudMono::Ptr> box_footprints;
+
+  /// Container for storing the largest plane
+  PointCloudMono::Ptr max_plane_cloud;
+  float max_plane_z;
+  size_t max_plane_points_num;
+};
+
 class Palletization {
 
 public:
   Palletization(ros::NodeHandle nh, string base_frame, float th_xy, float th_z);
-  ~Palletization() = default;
+  ~Palletization();
 
 private:
-  /// Params
+  /// Params, read only after construction
   string base_frame_;
   float th_grid_rsl_;
   float th_z_rsl_;
   float th_theta_;
   float th_norm_;
 
-  /// Object surface point number
-  int max_plane_points_num_;
-
-  /// Container for storing the largest plane
-  PointCloudMono::Ptr max_plane_cloud_;
-  float max_plane_z_;
-
-  // The height of the object origin w.r.t. the base. This origin may not coincide
-  // with the mass centroid of the object, only used to infer its pose or ease
-  // the manipulation as it should be fixed with the object body.
-  std::vector<double> origin_heights_;
-
   /// Tool objects
   Transform *tf_;
 
@@ -126,35 +167,59 @@ private:
 
   ros::Publisher object_pose_puber_;
 
-  /// Point clouds
-  // Source point cloud
-  PointCloudMono::Ptr src_mono_cloud_;
-
-  // Source cloud after down sampling
-  PointCloudMono::Ptr src_dsp_mono_;
-
-  // Normals of down sampling cloud
-  CloudN::Ptr src_normals_;
+  /// Stack model shared by the requests using it
+  boost::mutex stack_mutex_;
+  PalletStack stack_;
 
-  // Normal filtered cloud index and corresponding cloud
-  pcl::PointIndices::Ptr idx_norm_fit_;
-  PointCloudMono::Ptr cloud_norm_fit_mono_;
+  /// Contexts not in use by any request
+  boost::mutex pool_mutex_;
+  vector<PalletContext*> free_contexts_;
+  vector<PalletContext*> all_contexts_;
 
-  // Clustered points
-  vector<float> plane_z_values_;
-  vector<pcl::PointIndices> seed_clusters_indices_;
+  /// Get a context from the pool, a new one is created if all are in use
+  PalletContext *acquireContext();
+  void releaseContext(PalletContext *ctx);
 
   bool getObjectInfoCb(hope::GetObjectPose::Request &req,
                        hope::GetObjectPose::Response &res);
 
-  void computeNormalAndFilter();
-  void reset();
+  /// Process the request with the given context
+  bool process(PalletContext &ctx, const hope::GetObjectPose::Request &req,
+               int& category, geometry_msgs::Pose& pose);
+
+  /**
+   * Find the box top among the points near the known heights in ctx.origin_heights.
+   * The points within th_z_rsl_ to each height are collected in one pass, and the largest
+   * xy connected patch of all heights is taken as the box top.
+   */
+  bool processKnownHeights(PalletContext &ctx, int& category, geometry_msgs::Pose& pose);
+
+  /**
+   * Get all box tops on the top layer from the z clusters. The clusters within th_z_rsl_
+   * to the highest one covering at least th_min_top_area_ form the top layer, and each of
+   * them is split by xy distance into box tops. Results are stored in ctx.box_poses and so on.
+   */
+  bool getTopLayerBoxes(PalletContext &ctx);
+
+  /**
+   * Ratio of the area covered by the patch to that of its bounding rotated rect.
+   * @param footprint Output corners of the rotated rect
+   */
+  float getFillRatio(PalletContext &ctx, const PointCloudMono::Ptr &patch, PointCloudMono::Ptr &footprint);
+
+  /// Answer the request with the remembered boxes if the stack model is consistent with the cloud
+  bool verifyStackModel(PalletContext &ctx);
+
+  /// Replace the stack model with the boxes in ctx
+  void resetStackModel(const PalletContext &ctx);
+
+  void computeNormalAndFilter(PalletContext &ctx);
 
-  void extractPlaneForEachZ(PointCloudMono::Ptr cloud_norm_fit);
-  void zClustering(const PointCloudMono::Ptr& cloud_norm_fit_mono);
+  void extractPlaneForEachZ(PalletContext &ctx);
+  void zClustering(PalletContext &ctx);
 
-  void getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono);
-  bool postProcessing(int& category, geometry_msgs::Pose& pose);
+  void getPlane(PalletContext &ctx, size_t id, float z_in);
+  bool postProcessing(PalletContext &ctx, int& category, geometry_msgs::Pose& pose);
 };
 
 
@@ -0,0 +1,164 @@
+#include "plane_map.h"
+
+#include <algorithm>
+
+using namespace std;
+
+PlaneMap::PlaneMap(float resolution, float z_tolerance, size_t max_planes, size_t max_cells,
+                   uint16_t min_hits) :
+  resolution_(resolution),
+  z_tolerance_(z_tolerance),
+  max_planes_(max_planes),
+  max_cells_(max_cells),
+  min_hits_(min_hits)
+{
+}
+
+MapPlane &PlaneMap::getPlaneToFuse(float z, double stamp)
+{
+  // Find the plane with the closest z level
+  int best = -1;
+  float best_dis = z_tolerance_;
+  for (size_t i = 0; i < planes_.size(); ++i) {
+    float dis = fabs(planes_[i].z - z);
+    if (dis <= best_dis) {
+      best_dis = dis;
+      best = int(i);
+    }
+  }
+
+  if (best < 0) {
+    if (planes_.size() >= max_planes_) {
+      // Replace the plane observed least recently
+      best = 0;
+      for (size_t i = 1; i < planes_.size(); ++i) {
+        if (planes_[i].last_seen < planes_[best].last_seen) best = int(i);
+      }
+      planes_[best] = MapPlane();
+    }
+    else {
+      best = int(planes_.size());
+      planes_.push_back(MapPlane());
+    }
+    planes_[best].z = z;
+  }
+
+  MapPlane &plane = planes_[best];
+  // Running average of z, the weight of a new detection is bounded below so that
+  // the plane could still follow slow changes after long observation
+  plane.observations++;
+  float w = 1.0f / float(plane.observations < 10 ? plane.observations : 10);
+  plane.z += w * (z - plane.z);
+  plane.last_seen = stamp;
+  plane.changed = true;
+  return plane;
+}
+
+void PlaneMap::addPoint(MapPlane &plane, const pcl::PointXYZ &pt)
+{
+  int64_t key = toKey(pt.x, pt.y);
+  if (!visited_.insert(key).second) return;
+  auto it = plane.cells.find(key);
+  if (it != plane.cells.end()) {
+    if (it->second < UINT16_MAX) it->second++;
+  }
+  else if (plane.cells.size() < max_cells_) {
+    plane.cells.emplace(key, 1);
+  }
+  else {
+    plane.dropped++;
+  }
+}
+
+void PlaneMap::integrate(const PointCloudMono::Ptr& cloud, const vector<int> &indices, float z, double stamp)
+{
+  if (indices.empty()) return;
+  MapPlane &plane = getPlaneToFuse(z, stamp);
+  visited_.clear();
+  for (int i : indices) {
+    addPoint(plane, cloud->points[i]);
+  }
+}
+
+void PlaneMap::integrate(const PointCloudMono::Ptr& cloud, float z, double stamp)
+{
+  if (cloud->points.empty()) return;
+  MapPlane &plane = getPlaneToFuse(z, stamp);
+  visited_.clear();
+  for (const auto & pt : cloud->points) {
+    addPoint(plane, pt);
+  }
+}
+
+size_t PlaneMap::prune(double stamp, double ttl)
+{
+  size_t num = planes_.size();
+  planes_.erase(remove_if(planes_.begin(), planes_.end(), [stamp, ttl](const MapPlane &plane) {
+    return stamp - plane.last_seen > ttl;
+  }), planes_.end());
+  return num - planes_.size();
+}
+
+void PlaneMap::getChanged(vector<size_t> &ids)
+{
+  ids.clear();
+  for (size_t i = 0; i < planes_.size(); ++i) {
+    if (!planes_[i].changed) continue;
+    ids.push_back(i);
+    planes_[i].changed = false;
+  }
+}
+
+void PlaneMap::getCells(size_t id, PointCloudMono::Ptr &cloud) const
+{
+  const MapPlane &plane = planes_[id];
+  cloud->clear();
+  cloud->points.reserve(plane.cells.size());
+  for (const auto & cell : plane.cells) {
+    if (cell.second < min_hits_) continue;
+    float x, y;
+    fromKey(cell.first, x, y);
+    cloud->points.emplace_back(x, y, plane.z);
+  }
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+  cloud->is_dense = true;
+}
+
+bool PlaneMap::getExtent(size_t id, float &min_x, float &min_y, float &max_x, float &max_y) const
+{
+  const MapPlane &plane = planes_[id];
+  min_x = FLT_MAX;
+  min_y = FLT_MAX;
+  max_x = -FLT_MAX;
+  max_y = -FLT_MAX;
+  bool found = false;
+  for (const auto & cell : plane.cells) {
+    if (cell.second < min_hits_) continue;
+    found = true;
+    float x, y;
+    fromKey(cell.first, x, y);
+    if (x < min_x) min_x = x;
+    if (y < min_y) min_y = y;
+    if (x > max_x) max_x = x;
+    if (y > max_y) max_y = y;
+  }
+  if (!found) return false;
+
+  // Extend from the cell centers to the cell borders
+  float half = 0.5f * resolution_;
+  min_x -= half;
+  min_y -= half;
+  max_x += half;
+  max_y += half;
+  return true;
+}
+
+float PlaneMap::getArea(size_t id) const
+{
+  size_t num = 0;
+  for (const auto & cell : planes_[id].cells) {
+    if (cell.second >= min_hits_) num++;
+  }
+  return num * resolution_ * resolution_;
+}
@@ -0,0 +1,122 @@
+#ifndef PLANE_MAP_H
+#define PLANE_MAP_H
+
+// STL
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "utilities.h"
+
+
+/**
+ * A horizontal plane in the map. Its occupancy is stored sparsely as hit counts of the
+ * XY cells, the cells are aligned to the origin of the base frame so that detections
+ * from different frames fall into the same cells.
+ */
+struct MapPlane
+{
+  float z;
+  // Number of frames in which this plane is observed
+  size_t observations;
+  // Time in second when this plane is last observed
+  double last_seen;
+  // Whether the plane is changed since last call of PlaneMap::getChanged
+  bool changed;
+  // Number of new cells dropped since the plane has reached the max number of cells
+  size_t dropped;
+  std::unordered_map<int64_t, uint16_t> cells;
+};
+
+/**
+ * Persistent map of horizontal planes fused from the detections of multiple frames.
+ * Planes are keyed by their z level. The memory is bounded by the max number of planes
+ * and the max number of cells in each plane, and planes not observed for a while could
+ * be pruned. A cell gets at most one hit from each detection however many points fall
+ * into it, and only cells hit at least min_hits times are reported, so that the noise of
+ * single frames does not stay in the map.
+ */
+class PlaneMap
+{
+public:
+  /**
+   * @param resolution Edge length of a cell in meter, typically th_grid_rsl_
+   * @param z_tolerance Detections within this distance in z to a plane are fused into it
+   * @param max_planes Max number of planes, the stalest plane is dropped for a new one
+   * @param max_cells Max number of cells in each plane, new cells are dropped beyond it
+   * and counted in MapPlane::dropped
+   * @param min_hits Min number of hits of a cell to be reported
+   */
+  PlaneMap(float resolution, float z_tolerance, size_t max_planes = 16, size_t max_cells = 65536,
+           uint16_t min_hits = 3);
+
+  /**
+   * Fuse the points of a plane detection into the map. The points should be in
+   * the base frame.
+   * @param cloud Cloud containing the plane points
+   * @param indices Indices of the plane points in cloud
+   * @param z Mean z of the plane points
+   * @param stamp Time of the detection in second
+   */
+  void integrate(const PointCloudMono::Ptr& cloud, const std::vector<int> &indices, float z, double stamp);
+
+  /// Fuse all points of the cloud as a plane detection
+  void integrate(const PointCloudMono::Ptr& cloud, float z, double stamp);
+
+  /// Remove the planes not observed within ttl seconds before stamp, return the number removed
+  size_t prune(double stamp, double ttl);
+
+  inline void setMinHits(uint16_t min_hits) { min_hits_ = min_hits; }
+
+  /// Get the indices of planes changed since last call and reset their flags
+  void getChanged(std::vector<size_t> &ids);
+
+  /**
+   * Get the centers of the cells of a plane hit at least min_hits times.
+   * @param id Index of the plane in planes_
+   * @param cloud Output cloud, with z equals to the plane z
+   */
+  void getCells(size_t id, PointCloudMono::Ptr &cloud) const;
+
+  /// Get the XY extent of the reported cells of a plane, return false if it has none
+  bool getExtent(size_t id, float &min_x, float &min_y, float &max_x, float &max_y) const;
+
+  /// Area of a plane measured by its reported cells
+  float getArea(size_t id) const;
+
+  inline const std::vector<MapPlane> &planes() const { return planes_; }
+
+  inline void clear() { planes_.clear(); }
+
+private:
+  float resolution_;
+  float z_tolerance_;
+  size_t max_planes_;
+  size_t max_cells_;
+  uint16_t min_hits_;
+
+  std::vector<MapPlane> planes_;
+  // Cells already hit by the detection being integrated
+  std::unordered_set<int64_t> visited_;
+
+  /// Get the plane to fuse a detection with given z into, a new one is added if needed
+  MapPlane &getPlaneToFuse(float z, double stamp);
+  void addPoint(MapPlane &plane, const pcl::PointXYZ &pt);
+
+  inline int64_t toKey(float x, float y) const
+  {
+    int64_t c = int64_t(floor(x / resolution_));
+    int64_t r = int64_t(floor(y / resolution_));
+    return int64_t((uint64_t(c) << 32) | uint32_t(r));
+  }
+
+  inline void fromKey(int64_t key, float &x, float &y) const
+  {
+    // Cell center
+    x = (float(int32_t(key >> 32)) + 0.5f) * resolution_;
+    y = (float(int32_t(key & 0xffffffff)) + 0.5f) * resolution_;
+  }
+};
+
+#endif // PLANE_MAP_H
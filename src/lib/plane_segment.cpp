@@ -19,6 +19,14 @@ float th_norm_;
 float th_min_depth_ = 0.3;
 float th_max_depth_ = 8.0;
 
+// Tracking parameters of the max plane, only used in real-time mode
+float th_track_band_ = 0.01; // Half width of the z band for verifying a tracked plane
+float th_track_coverage_ = 0.7; // Min ratio of plane cells observed to pass the verification
+float track_alpha_ = 0.3; // Weight of the observed z in the low-pass filter
+
+// Plane ID tracking parameters, used in both modes
+float th_id_gate_ = 0.1; // Default gate in meter, see PlaneSegment::setIDGate
+
 bool cal_hull_ = false;
 bool show_cluster_ = false;
 bool show_egi_ = false;
@@ -38,10 +46,12 @@ PlaneSegment::PlaneSegment(data_type mode, float th_xy, float th_z, string base_
   src_normals_(new CloudN),
   idx_norm_fit_(new pcl::PointIndices),
   src_z_inliers_(new pcl::PointIndices),
+  plane_buffer_(new PointCloudMono),
   tf_(new Transform),
   base_frame_(std::move(base_frame)),
   viewer(new pcl::visualization::PCLVisualizer("HoPE Result")),
-  hst_("total")
+  hst_("total"),
+  tracker_(5, th_id_gate_)
 {
   th_grid_rsl_ = th_xy;
   th_z_rsl_ = th_z;
@@ -106,6 +116,11 @@ void PlaneSegment::setT(float tx = 0.0, float ty = 0.0, float tz = 0.0)
   tz_ = tz;
 }
 
+void PlaneSegment::setIDGate(float gate)
+{
+  tracker_.setGate(gate);
+}
+
 // Notice that the point cloud may not transformed before this function
 void PlaneSegment::getHorizontalPlanes(PointCloud::Ptr cloud)
 {
@@ -202,16 +217,8 @@ void PlaneSegment::findAllPlanesRG(int norm_k, int num_n, float s_th, float c_th
   reg.extract(clusters);
   //cout << "Number of clusters: " << clusters.size () << endl;
 
-  for (size_t i = 0; i < clusters.size(); ++i) {
-    PointCloudMono::Ptr cloud_p (new PointCloudMono);
-    pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
-    idx_seed->indices = clusters[i].indices;
-    Utilities::getCloudByInliers(cloud_norm_fit_mono_, cloud_p, idx_seed, false, false);
-    plane_points_.push_back(cloud_p);
-
-    float z_mean, z_max, z_min, z_mid;
-    Utilities::getCloudZInfo(cloud_p, z_mean, z_max, z_min, z_mid);
-    setFeatures(z_mean, cloud_p);
+  for (auto & cluster : clusters) {
+    addPlane(cloud_norm_fit_mono_, cluster.indices);
   }
 }
 
@@ -248,7 +255,6 @@ void PlaneSegment::findAllPlanesRANSAC(bool isOptimize, int maxIter,
 
   while (cloud_norm_fit_mono_->points.size() > omit * n_points) {
     // Segment the largest planar component from the remaining cloud
-    PointCloudMono::Ptr  cloud_p(new PointCloudMono);
     PointCloudMono::Ptr  cloud_f(new PointCloudMono);
     seg.setInputCloud(cloud_norm_fit_mono_);
     seg.segment(*inliers, *coefficients);
@@ -256,21 +262,9 @@ void PlaneSegment::findAllPlanesRANSAC(bool isOptimize, int maxIter,
       cerr << "Could not estimate a planar model for the given dataset." << endl;
       break;
     }
-    // Extract the inliers
-    Utilities::getCloudByInliers(cloud_norm_fit_mono_, cloud_p, inliers, false, false);
-    cout << "PointCloud representing the planar component: " << cloud_p->points.size() << " data points." << endl;
-    plane_points_.push_back(cloud_p);
-
-    if (cal_hull_) {
-      PointCloud::Ptr cloud_2d_rgb(new PointCloud);
-      PointCloudMono::Ptr cloud_proj(new PointCloudMono);
-
-      Utilities::projectCloudTo2D(coefficients, cloud_p, cloud_proj);
-      Utilities::convertToColorCloud(cloud_proj, cloud_2d_rgb, 100, 100, 100);
-      computeHull(cloud_2d_rgb);
-    }
-
-    setFeatures(coefficients->values[3], cloud_p);
+    // Record the inliers
+    cout << "PointCloud representing the planar component: " << inliers->indices.size() << " data points." << endl;
+    addPlane(cloud_norm_fit_mono_, inliers->indices);
 
     //std::stringstream ss;
     //ss << "plane_" << i << ".pcd";
@@ -349,74 +343,86 @@ void PlaneSegment::extractPlaneForEachZ(PointCloudMono::Ptr cloud_norm_fit)
 
 void PlaneSegment::getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono)
 {
-  pcl::ModelCoefficients::Ptr cluster_coeff(new pcl::ModelCoefficients);
-  // Plane function: ax + by + cz + d = 0, here coeff[3] = d = -cz
-  cluster_coeff->values.push_back(0.0);
-  cluster_coeff->values.push_back(0.0);
-  cluster_coeff->values.push_back(1.0);
-  cluster_coeff->values.push_back(-z_in);
-
-  pcl::PointIndices::Ptr idx_seed (new pcl::PointIndices);
-  idx_seed->indices = seed_clusters_indices_[id].indices;
-
-  // Extract the plane points indexed by idx_seed
-  PointCloudMono::Ptr cluster_near_z(new PointCloudMono);
-  Utilities::getCloudByInliers(cloud_norm_fit_mono, cluster_near_z, idx_seed, false, false);
-
   // If the points do not pass the error test, return
-  PointCloud::Ptr cluster_2d_rgb(new PointCloud);
   if (!gaussianImageAnalysis(id)) return;
 
-  // If the cluster of points pass the check,
-  // push it and corresponding projected points into resulting vectors
-  plane_results_.push_back(cluster_2d_rgb);
-  plane_points_.push_back(cluster_near_z);
+  // If the cluster of points pass the check, record it. The plane points are
+  // only copied into the frame buffer, the other results are built on request
+  addPlane(cloud_norm_fit_mono, seed_clusters_indices_[id].indices);
+}
 
-  // Use convex hull to represent the plane patch
-  if (cal_hull_) {
-    computeHull(cluster_2d_rgb);
+void PlaneSegment::addPlane(const PointCloudMono::Ptr& cloud, const vector<int> &indices)
+{
+  if (indices.empty()) return;
+
+  PlaneRecord record{};
+  record.begin = plane_buffer_->points.size();
+  record.min_x = FLT_MAX;
+  record.min_y = FLT_MAX;
+  record.max_x = -FLT_MAX;
+  record.max_y = -FLT_MAX;
+
+  float z_sum = 0;
+  for (int i : indices) {
+    const pcl::PointXYZ &pt = cloud->points[i];
+    plane_buffer_->points.push_back(pt);
+    z_sum += pt.z;
+    if (pt.x < record.min_x) record.min_x = pt.x;
+    if (pt.y < record.min_y) record.min_y = pt.y;
+    if (pt.x > record.max_x) record.max_x = pt.x;
+    if (pt.y > record.max_y) record.max_y = pt.y;
   }
+  record.end = plane_buffer_->points.size();
+  record.z = z_sum / record.size();
 
-  setFeatures(z_in, cluster_near_z);
+  grid_.fromCloud(plane_buffer_, th_grid_rsl_, record.begin, record.end);
+  record.area = grid_.occupied_num_ * th_grid_rsl_ * th_grid_rsl_;
 
-  // Update the data of the max plane detected
-  //  if (cluster_2d_rgb->points.size() > max_plane_points_num_) {
-  //    plane_max_result_ = cluster_2d_rgb;
-  //    max_plane_cloud_ = cluster_near_z;
-  //    max_coeff_ = feature;
-  //    max_plane_points_num_ = cluster_2d_rgb->points.size();
-  //  }
+  plane_records_.push_back(record);
+}
+
+PointCloudMono::Ptr PlaneSegment::getPlanePoints(size_t i) const
+{
+  const PlaneRecord &record = plane_records_[i];
+  PointCloudMono::Ptr cloud(new PointCloudMono);
+  cloud->points.assign(plane_buffer_->points.begin() + record.begin,
+                       plane_buffer_->points.begin() + record.end);
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+  cloud->is_dense = true;
+  return cloud;
 }
 
-void PlaneSegment::computeHull(PointCloud::Ptr cluster_2d_rgb)
+void PlaneSegment::getPlaneHull(size_t i, PointCloudMono::Ptr &hull, pcl::PolygonMesh &mesh) const
 {
-  PointCloud::Ptr cluster_hull(new PointCloud);
-  pcl::ConvexHull<pcl::PointXYZRGB> hull;
-  pcl::PolygonMesh cluster_mesh;
-
-  hull.setInputCloud(cluster_2d_rgb);
-  hull.setComputeAreaVolume(true);
-  hull.reconstruct(*cluster_hull);
-  hull.reconstruct(cluster_mesh);
-
-  plane_hull_.push_back(cluster_hull);
-  plane_mesh_.push_back(cluster_mesh);
-  plane_max_hull_ = cluster_hull;
-  plane_max_mesh_ = cluster_mesh;
+  // Project the plane points to its mean z before computing the convex hull
+  PointCloudMono::Ptr cloud_2d(new PointCloudMono);
+  Utilities::planeTo2D(plane_records_[i].z, getPlanePoints(i), cloud_2d);
+
+  pcl::ConvexHull<pcl::PointXYZ> convex_hull;
+  convex_hull.setInputCloud(cloud_2d);
+  convex_hull.setComputeAreaVolume(true);
+  convex_hull.reconstruct(*hull);
+  convex_hull.reconstruct(mesh);
 }
 
-void PlaneSegment::setFeatures(float z_in, PointCloudMono::Ptr cluster)
+void PlaneSegment::getPlaneError(size_t i, PointCloud::Ptr &cloud_err) const
 {
-  // Prepare the feature vector for each plane to identify its id
-  vector<float> feature;
-  feature.push_back(z_in); // z value
-  pcl::PointXYZ minPt, maxPt;
-  pcl::getMinMax3D(*cluster, minPt, maxPt);
-  feature.push_back(minPt.x); // cluster min x
-  feature.push_back(minPt.y); // cluster min y
-  feature.push_back(maxPt.x); // cluster max x
-  feature.push_back(maxPt.y); // cluster max y
-  plane_coeff_.push_back(feature);
+  const PlaneRecord &record = plane_records_[i];
+  cloud_err->resize(record.size());
+  for (size_t k = 0; k < record.size(); ++k) {
+    const pcl::PointXYZ &pt = plane_buffer_->points[record.begin + k];
+    uint8_t r = 0, g = 0, b = 0;
+    // Error equals to th_z_rsl_ is rendered with the hottest color
+    float err = fabs(pt.z - record.z) / th_z_rsl_;
+    Utilities::heatmapRGB(err > 1.0f ? 1.0f : err, r, g, b);
+    cloud_err->points[k].x = pt.x;
+    cloud_err->points[k].y = pt.y;
+    cloud_err->points[k].z = pt.z;
+    cloud_err->points[k].r = r;
+    cloud_err->points[k].g = g;
+    cloud_err->points[k].b = b;
+  }
 }
 
 bool PlaneSegment::gaussianImageAnalysis(size_t id)
@@ -495,40 +501,15 @@ bool PlaneSegment::gaussianImageAnalysis(size_t id)
 
 void PlaneSegment::setID()
 {
-  if (global_id_temp_.empty()) {
-    // Initialize the global id temp with the first detection
-    for (size_t i = 0; i < plane_coeff_.size(); ++i) {
-      global_id_temp_.push_back(i);
-      global_coeff_temp_.push_back(plane_coeff_[i]);
-    }
-  }
-  else {
-    vector<int> local_id_temp;
-    Utilities::matchID(global_coeff_temp_, plane_coeff_, global_id_temp_, local_id_temp, 5);
-
-    // Update global result temp
-    global_coeff_temp_.clear();
-    global_id_temp_.clear();
-    for (size_t i = 0; i < plane_coeff_.size(); ++i) {
-      global_id_temp_.push_back(local_id_temp[i]);
-      global_coeff_temp_.push_back(plane_coeff_[i]);
-    }
+  plane_features_.clear();
+  for (auto & record : plane_records_) {
+    plane_features_.push_back(record.z);
+    plane_features_.push_back(record.min_x);
+    plane_features_.push_back(record.min_y);
+    plane_features_.push_back(record.max_x);
+    plane_features_.push_back(record.max_y);
   }
-}
-
-int PlaneSegment::checkSimilar(vector<float> coeff)
-{
-  int id = -1;
-  float distemp = FLT_MAX;
-  for (size_t i = 0; i < global_coeff_temp_.size(); ++i) {
-    vector<float> coeff_prev = global_coeff_temp_[i];
-    float dis = Utilities::getDistance(coeff_prev, coeff);
-    if (dis < distemp) {
-      distemp = dis;
-      id = global_id_temp_[i];
-    }
-  }
-  return id;
+  tracker_.update(plane_features_, global_id_temp_);
 }
 
 void PlaneSegment::visualizeResult(bool display_source, bool display_raw,
@@ -560,22 +541,24 @@ void PlaneSegment::visualizeResult(bool display_source, bool display_raw,
     }
   }
 
-  for (size_t i = 0; i < plane_points_.size(); i++) {
+  for (size_t i = 0; i < plane_records_.size(); i++) {
     int id = global_id_temp_[i];
     Vec3f c = Utilities::getColorWithID(id);
     if (display_raw) {
       // Add raw plane points
       name = Utilities::getName(i, "plane_", -1);
-      viewer->addPointCloud<pcl::PointXYZ>(plane_points_[i], name);
+      viewer->addPointCloud<pcl::PointXYZ>(getPlanePoints(i), name);
       viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 10.0, name);
       viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, c[0], c[1], c[2], name);
     }
     if (display_err) {
       // Add results with error display
       name = Utilities::getName(i, "error_", -1);
-      pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> err_rgb(plane_results_[i]);
-      if (!viewer->updatePointCloud(plane_results_[i], err_rgb, name)){
-        viewer->addPointCloud<pcl::PointXYZRGB>(plane_results_[i], err_rgb, name);
+      PointCloud::Ptr cloud_err(new PointCloud);
+      getPlaneError(i, cloud_err);
+      pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> err_rgb(cloud_err);
+      if (!viewer->updatePointCloud(cloud_err, err_rgb, name)){
+        viewer->addPointCloud<pcl::PointXYZRGB>(cloud_err, err_rgb, name);
         viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 10.0, name);
       }
     }
@@ -586,13 +569,16 @@ void PlaneSegment::visualizeResult(bool display_source, bool display_raw,
       //viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 10.0, name);
       //viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, c[0], c[1], c[2], name);
       // Add hull mesh
+      PointCloudMono::Ptr hull(new PointCloudMono);
+      pcl::PolygonMesh mesh;
+      getPlaneHull(i, hull, mesh);
       name = Utilities::getName(i, "mesh_", -1);
-      viewer->addPolygonMesh(plane_mesh_[i], name);
+      viewer->addPolygonMesh(mesh, name);
       viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_OPACITY, 0.9, name);
       viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_COLOR, c[0], c[1], c[2], name);
     }
   }
-  cout << "Total plane patches #: " << plane_points_.size() << endl;
+  cout << "Total plane patches #: " << plane_records_.size() << endl;
 
   while (!viewer->wasStopped()) {
     viewer->spinOnce(1); // ms
@@ -661,12 +647,9 @@ pcl::PolygonMesh PlaneSegment::mesh(const PointCloudMono::Ptr point_cloud,
 
 void PlaneSegment::reset()
 {
-  // Clear temp
-  plane_results_.clear();
-  plane_points_.clear();
-  plane_coeff_.clear();
-  plane_hull_.clear();
-  plane_mesh_.clear();
+  // Clear temp, the frame buffer keeps its capacity for the next frame
+  plane_records_.clear();
+  plane_buffer_->clear();
 
   plane_z_values_.clear();
   cloud_fit_parts_.clear();
@@ -704,6 +687,7 @@ void PlaneSegment::computeNormalAndFilter()
 PlaneSegmentRT::PlaneSegmentRT(float th_xy, float th_z, ros::NodeHandle nh, string base_frame, const string &cloud_topic) :
   nh_(nh),
   src_mono_cloud_(new PointCloudMono),
+  src_organized_cloud_(new PointCloudMono),
   cloud_norm_fit_mono_(new PointCloudMono),
   cloud_norm_fit_(new CloudN),
   src_dsp_mono_(new PointCloudMono),
@@ -715,8 +699,14 @@ PlaneSegmentRT::PlaneSegmentRT(float th_xy, float th_z, ros::NodeHandle nh, stri
   pe_(new PoseEstimation(th_grid_rsl_)),
   base_frame_(std::move(base_frame)),
   max_plane_z_(-1000.0f),
-  origin_height_(0.0f),
-  aggressive_merge_(true)
+  aggressive_merge_(true),
+  concave_contour_(true),
+  enable_tracking_(false),
+  refresh_interval_(30),
+  plane_map_ttl_(30.0),
+  organized_segment_(false),
+  frames_since_refresh_(0),
+  plane_map_(th_xy, th_z)
 {
   th_grid_rsl_ = th_xy;
   th_z_rsl_ = th_z;
@@ -726,6 +716,7 @@ PlaneSegmentRT::PlaneSegmentRT(float th_xy, float th_z, ros::NodeHandle nh, stri
 
   // For storing max hull id and area
   max_plane_points_num_ = 0;
+  gravity_descriptor_ = false;
 
   // Register the callback if using real point cloud data
   source_suber = nh_.subscribe<sensor_msgs::PointCloud2>(cloud_topic, 1,
@@ -738,18 +729,65 @@ PlaneSegmentRT::PlaneSegmentRT(float th_xy, float th_z, ros::NodeHandle nh, stri
   server_.setCallback(f);
 
   extract_on_top_server_ = nh_.advertiseService("extract_object_on_top", &PlaneSegmentRT::extractOnTopCallback, this);
+  plane_map_server_ = nh_.advertiseService("get_plane_map", &PlaneSegmentRT::getPlaneMapCallback, this);
+  extract_objects_on_top_server_ = nh_.advertiseService("extract_objects_on_top",
+                                                        &PlaneSegmentRT::extractObjectsOnTopCallback, this);
 
   // Detect table surface as an obstacle
   plane_cloud_puber_ = nh_.advertise<sensor_msgs::PointCloud2>("plane_points", 1);
   max_plane_puber_ = nh_.advertise<sensor_msgs::PointCloud2>("max_plane", 1);
   max_contour_puber_ = nh_.advertise<sensor_msgs::PointCloud2>("max_contour", 1);
   on_plane_obj_puber_ = nh_.advertise<geometry_msgs::PoseArray>("obj_poses", 1, true);
+  // Only the changed layers of the plane map are published in each frame
+  plane_map_puber_ = nh_.advertise<sensor_msgs::PointCloud2>("plane_map", 16);
+
+  latest_frame_.cloud.reset(new PointCloudMono);
+  latest_frame_.organized_cloud.reset(new PointCloudMono);
+  latest_frame_.contour.reset(new PointCloudMono);
+  latest_frame_.plane_z = max_plane_z_;
+  latest_frame_.aggressive_merge = aggressive_merge_;
+  new_frame_ = false;
+  has_query_ = false;
+  merge_request_ = aggressive_merge_;
+  stop_worker_ = false;
+  worker_ = boost::thread(&PlaneSegmentRT::precomputeLoop, this);
+
+  estimate_pose_as_ = new actionlib::SimpleActionServer<hope::EstimateObjectPoseAction>(
+        nh_, "estimate_object_pose", boost::bind(&PlaneSegmentRT::estimatePoseExecuteCallback, this, _1), false);
+  estimate_pose_as_->start();
+}
+
+PlaneSegmentRT::~PlaneSegmentRT()
+{
+  estimate_pose_as_->shutdown();
+  delete estimate_pose_as_;
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    stop_worker_ = true;
+  }
+  frame_cond_.notify_all();
+  worker_.join();
 }
 
 void PlaneSegmentRT::getHorizontalPlanes() {
   // If using real data, the transform from camera frame to base frame
   // need to be provided
   getSourceCloud();
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    aggressive_merge_ = merge_request_;
+  }
+
+  // In static scenes the max plane found before is verified instead of extracted again
+  if (enable_tracking_ && frames_since_refresh_ < refresh_interval_ && verifyTrackedPlane()) {
+    frames_since_refresh_++;
+    plane_map_.integrate(max_plane_cloud_, max_plane_z_, ros::Time::now().toSec());
+    updatePlaneMap();
+    visualizeResult();
+    updateSnapshot();
+    return;
+  }
+  frames_since_refresh_ = 0;
 
   // Down sampling
   Utilities::downSampling(src_mono_cloud_, src_dsp_mono_, th_grid_rsl_, th_z_rsl_);
@@ -762,7 +800,85 @@ void PlaneSegmentRT::getHorizontalPlanes() {
   reset();
   computeNormalAndFilter();
   findAllPlanes();
+  updatePlaneMap();
   visualizeResult();
+  updateSnapshot();
+}
+
+void PlaneSegmentRT::updateSnapshot()
+{
+  FrameSnapshot frame;
+  frame.stamp = src_stamp_;
+  frame.cloud = src_mono_cloud_;
+  frame.organized_cloud = organized_segment_ ? src_organized_cloud_ : PointCloudMono::Ptr(new PointCloudMono);
+  // The contour may be modified in place when tracking, so it is copied
+  frame.contour.reset(new PointCloudMono(*max_plane_contour_));
+  frame.plane_z = max_plane_z_;
+  frame.aggressive_merge = aggressive_merge_;
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    latest_frame_ = frame;
+    new_frame_ = true;
+  }
+  // Both the worker and the action may be waiting
+  frame_cond_.notify_all();
+}
+
+void PlaneSegmentRT::requestMergeMode(bool aggressive_merge)
+{
+  boost::mutex::scoped_lock lock(cache_mutex_);
+  merge_request_ = aggressive_merge;
+}
+
+void PlaneSegmentRT::precomputeLoop()
+{
+  // Seconds without a request before the worker stops precomputing the last query
+  const double query_ttl = 10.0;
+
+  while (true) {
+    FrameSnapshot frame;
+    ObjectQuery query;
+    {
+      boost::mutex::scoped_lock lock(cache_mutex_);
+      while (!stop_worker_ && !(new_frame_ && has_query_)) {
+        frame_cond_.wait(lock);
+      }
+      if (stop_worker_) return;
+      new_frame_ = false;
+      if ((ros::WallTime::now() - last_query_time_).toSec() > query_ttl) {
+        has_query_ = false;
+        continue;
+      }
+      frame = latest_frame_;
+      query = last_query_;
+    }
+
+    ObjectResult result;
+    if (findInCache(frame.stamp, query, result)) continue;
+    postProcessing(frame, query, result);
+    addToCache(result);
+  }
+}
+
+bool PlaneSegmentRT::findInCache(const ros::Time &stamp, const ObjectQuery &query, ObjectResult &result)
+{
+  boost::mutex::scoped_lock lock(cache_mutex_);
+  for (auto it = cache_.rbegin(); it != cache_.rend(); ++it) {
+    if (it->stamp == stamp && it->query == query) {
+      result = *it;
+      return true;
+    }
+  }
+  return false;
+}
+
+void PlaneSegmentRT::addToCache(const ObjectResult &result)
+{
+  // Only a few recent results are useful since the frames keep coming
+  const size_t cache_size = 8;
+  boost::mutex::scoped_lock lock(cache_mutex_);
+  cache_.push_back(result);
+  while (cache_.size() > cache_size) cache_.pop_front();
 }
 
 void PlaneSegmentRT::getSourceCloud()
@@ -793,60 +909,118 @@ void PlaneSegmentRT::cloudCallback(const sensor_msgs::PointCloud2ConstPtr &msg)
 
   if (!tf_->getTransform(base_frame_, msg->header.frame_id)) return;
   tf_->doTransform(src_clamped, src_mono_cloud_);
+  src_stamp_ = msg->header.stamp;
+
+  // Scatter the transformed points back to their pixels, so that no extra transform is needed.
+  // A new cloud is allocated each time since the previous one may be held by a snapshot.
+  src_organized_cloud_.reset(new PointCloudMono);
+  if (src_temp->height > 1) {
+    pcl::PointXYZ nan_point;
+    nan_point.x = nan_point.y = nan_point.z = std::numeric_limits<float>::quiet_NaN();
+    src_organized_cloud_->points.assign(src_temp->points.size(), nan_point);
+    src_organized_cloud_->width = src_temp->width;
+    src_organized_cloud_->height = src_temp->height;
+    src_organized_cloud_->is_dense = false;
+    for (size_t i = 0; i < src_z_inliers_->indices.size(); ++i) {
+      src_organized_cloud_->points[src_z_inliers_->indices[i]] = src_mono_cloud_->points[i];
+    }
+  }
 }
 
 void PlaneSegmentRT::configCallback(hope::hopeConfig &config, uint32_t level) {
   min_height_ = config.min_height_cfg;
   max_height_ = config.max_height_cfg;
+  concave_contour_ = config.concave_contour_cfg;
+  enable_tracking_ = config.enable_tracking_cfg;
+  refresh_interval_ = config.refresh_interval_cfg;
+  plane_map_ttl_ = config.plane_map_ttl_cfg;
+  plane_map_.setMinHits(uint16_t(config.plane_map_min_hits_cfg));
+  organized_segment_ = config.organized_segment_cfg;
+  gravity_descriptor_ = config.gravity_descriptor_cfg;
+}
+
+void PlaneSegmentRT::preloadObjectModels(const vector<string> &paths)
+{
+  boost::mutex::scoped_lock lock(pe_mutex_);
+  pe_->preloadObjectModels(paths);
+}
+
+bool PlaneSegmentRT::makeQuery(const string &id, float origin_height, const vector<double> &origin_heights,
+                               const string &mesh_path, ObjectQuery &query)
+{
+  query.type = id;
+  query.do_cluster = true;
+  query.origin_height = 0;
+  query.origin_heights.clear();
+  query.mesh_path.clear();
+  if (id == hope::ExtractObjectOnTop::Request::CYLINDER || id == hope::ExtractObjectOnTop::Request::BOX) {
+    query.origin_height = origin_height;
+  } else if (id == hope::ExtractObjectOnTop::Request::MESH) {
+    query.mesh_path = mesh_path;
+    // Multiple models are recognized for each object cluster
+    query.do_cluster = mesh_path.find(',') != string::npos;
+  } else if (id == hope::ExtractObjectOnTop::Request::BOX_TOP) {
+    query.origin_heights = origin_heights;
+  } else if (id == "debug") {
+    query.origin_height = origin_height;
+    query.type = "cylinder";
+  } else {
+    return false;
+  }
+  return true;
 }
 
 bool PlaneSegmentRT::extractOnTopCallback(hope::ExtractObjectOnTop::Request &req,
                                           hope::ExtractObjectOnTop::Response &res)
 {
   ROS_INFO("HoPE Service: Received extract on top object %s call.", req.goal_id.id.c_str());
-  string object_type = req.goal_id.id;
-  bool do_cluster;
-  if (req.goal_id.id == req.CYLINDER) {
-    origin_height_ = req.origin_height;
-    object_type = "cylinder";
-    do_cluster = true;
-  } else if (req.goal_id.id == req.MESH) {
-    object_type = "mesh";
-    object_model_path_ = req.mesh_path;
-    do_cluster = false;
-  } else if (req.goal_id.id == req.BOX) {
-    origin_height_ = req.origin_height;
-    object_type = "box";
-    do_cluster = true;
-  } else if (req.goal_id.id == req.BOX_TOP) {
-    origin_heights_ = req.origin_heights;
-    object_type = "box_top";
-    do_cluster = true;
-  } else if (req.goal_id.id == "debug") {
-    origin_height_ = req.origin_height;
-    object_type = "cylinder";
-    do_cluster = true;
-    req.header.stamp = ros::Time::now();
-  }
-  else {
-    ROS_ERROR("HoPE: Unknown object type given in goal_id.id: %s", object_type.c_str());
+  ObjectQuery query;
+  if (!makeQuery(req.goal_id.id, req.origin_height, req.origin_heights, req.mesh_path, query)) {
+    ROS_ERROR("HoPE: Unknown object type given in goal_id.id: %s", req.goal_id.id.c_str());
     res.result_status = res.FAILED;
     return true;
   }
+  if (req.goal_id.id == "debug") {
+    req.header.stamp = ros::Time::now();
+  }
 
   
-  aggressive_merge_ = req.aggressive_merge;
+  requestMergeMode(req.aggressive_merge);
+
+  // The worker will precompute this query for the following frames, except for mesh
+  // queries, whose pose estimation is too expensive to run on every frame
+  FrameSnapshot frame;
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    last_query_ = query;
+    has_query_ = query.type != hope::ExtractObjectOnTop::Request::MESH;
+    last_query_time_ = ros::WallTime::now();
+    frame = latest_frame_;
+  }
+
+  ObjectResult result;
+  if (findInCache(frame.stamp, query, result)) {
+    ROS_DEBUG("HoPE Service: Answered from cache.");
+  } else {
+    // The spin thread is not blocked by a mesh estimation running for the action
+    postProcessing(frame, query, result, false);
+    if (!result.busy) addToCache(result);
+  }
+
+  if (result.ok) {
+    on_top_object_poses_ = result.poses;
+    on_top_object_categories_ = result.categories;
+    on_plane_obj_puber_.publish(on_top_object_poses_);
 
-  bool ok = postProcessing(do_cluster, object_type);
-  if (ok) {
-    int time_interval = on_top_object_poses_.header.stamp.sec - req.header.stamp.sec;
+    // Compare the stamp of the source cloud with that of the request
+    double time_interval = (frame.stamp - req.header.stamp).toSec();
     if (time_interval > 2) {
-      ROS_WARN("HoPE Service: Extract on top object failed due to lagging %d.", time_interval);
+      ROS_WARN("HoPE Service: Extract on top object failed due to lagging %.3f.", time_interval);
       res.result_status = res.SUCCEEDED;
       res.obj_poses = on_top_object_poses_;
       res.categories = on_top_object_categories_;
-    } else if (time_interval < 0) {
-      ROS_WARN("HoPE service: Extract on top object failed due to looking into past %d.", time_interval);
+    } else if (time_interval < -1) {
+      ROS_WARN("HoPE service: Extract on top object failed due to looking into past %.3f.", time_interval);
       res.result_status = res.FAILED;
     } else {
       ROS_INFO("HoPE Service: Extract on top object succeeded.");
@@ -860,6 +1034,143 @@ bool PlaneSegmentRT::extractOnTopCallback(hope::ExtractObjectOnTop::Request &req
   return true;
 }
 
+bool PlaneSegmentRT::extractObjectsOnTopCallback(hope::ExtractObjectsOnTop::Request &req,
+                                                 hope::ExtractObjectsOnTop::Response &res)
+{
+  ROS_INFO("HoPE Service: Received extract on top objects call with %d types.", int(req.types.size()));
+  res.result_status = res.FAILED;
+  if (req.types.empty()) return true;
+  if (!req.origin_heights.empty() && req.origin_heights.size() != req.types.size()) {
+    ROS_ERROR("HoPE: The number of origin heights should be 0 or equal to the number of types.");
+    return true;
+  }
+
+  requestMergeMode(req.aggressive_merge);
+  FrameSnapshot frame;
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    frame = latest_frame_;
+  }
+
+  // Same as the single type service, a request newer than the source cloud is refused
+  double time_interval = (frame.stamp - req.header.stamp).toSec();
+  if (time_interval < -1) {
+    ROS_WARN("HoPE service: Extract on top objects failed due to looking into past %.3f.", time_interval);
+    return true;
+  } else if (time_interval > 2) {
+    ROS_WARN("HoPE Service: Extract on top objects lagging %.3f.", time_interval);
+  }
+
+  // The clusters are only computed once for all types that need them
+  vector<PointCloudMono::Ptr> clusters[2];
+  bool clustered[2] = {false, false};
+  bool clustered_ok[2] = {false, false};
+
+  bool any_ok = false;
+  for (size_t t = 0; t < req.types.size(); ++t) {
+    ObjectResult result;
+    result.ok = false;
+    result.busy = false;
+    ObjectQuery query;
+    float origin_height = req.origin_heights.empty() ? 0.0f : req.origin_heights[t];
+    if (!makeQuery(req.types[t], origin_height, req.box_top_heights, req.mesh_path, query)) {
+      ROS_ERROR("HoPE: Unknown object type: %s", req.types[t].c_str());
+    } else if (!findInCache(frame.stamp, query, result)) {
+      int c = query.do_cluster ? 1 : 0;
+      if (!clustered[c]) {
+        clustered_ok[c] = getObjectClusters(frame, query.do_cluster, clusters[c]);
+        clustered[c] = true;
+      }
+      if (clustered_ok[c]) {
+        estimateObjectPoses(frame, query, clusters[c], result, AlignmentProgress(), false);
+        if (!result.busy) addToCache(result);
+      }
+    }
+
+    res.type_status.push_back(result.ok ? res.SUCCEEDED : res.FAILED);
+    if (!result.ok) {
+      result.poses.header.stamp = ros::Time::now();
+      result.poses.header.frame_id = base_frame_;
+    }
+    res.obj_poses.push_back(result.poses);
+    // Types without categories get an empty range
+    res.category_offsets.push_back(uint32_t(res.categories.size()));
+    if (result.ok) {
+      res.categories.insert(res.categories.end(), result.categories.begin(), result.categories.end());
+    }
+    any_ok |= result.ok;
+  }
+  if (any_ok) res.result_status = res.SUCCEEDED;
+  return true;
+}
+
+void PlaneSegmentRT::estimatePoseExecuteCallback(const hope::EstimateObjectPoseGoalConstPtr &goal)
+{
+  ROS_INFO("HoPE Action: Received estimate object pose goal.");
+  hope::EstimateObjectPoseResult action_result;
+  action_result.result_status = action_result.FAILED;
+
+  ObjectQuery query;
+  makeQuery(hope::ExtractObjectOnTop::Request::MESH, 0, vector<double>(), goal->mesh_path, query);
+
+  // Wait shortly for a frame extracted in the requested merge mode
+  FrameSnapshot frame;
+  {
+    boost::mutex::scoped_lock lock(cache_mutex_);
+    merge_request_ = goal->aggressive_merge;
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(2);
+    while (!stop_worker_ && latest_frame_.aggressive_merge != goal->aggressive_merge) {
+      if (!frame_cond_.timed_wait(lock, deadline)) break;
+    }
+    frame = latest_frame_;
+  }
+  if (frame.aggressive_merge != goal->aggressive_merge) {
+    ROS_WARN("HoPE Action: No frame extracted in the requested merge mode, the latest one is used.");
+  }
+  double time_interval = (frame.stamp - goal->header.stamp).toSec();
+  if (time_interval < -1) {
+    ROS_WARN("HoPE Action: Estimate object pose failed due to looking into past %.3f.", time_interval);
+    estimate_pose_as_->setAborted(action_result);
+    return;
+  }
+
+  ObjectResult result;
+  bool cached = findInCache(frame.stamp, query, result);
+  bool ok = cached && result.ok;
+  if (!cached) {
+    vector<PointCloudMono::Ptr> clusters;
+    hope::EstimateObjectPoseFeedback feedback;
+    ok = getObjectClusters(frame, query.do_cluster, clusters) &&
+        estimateObjectPoses(frame, query, clusters, result,
+                            [this, &feedback](int iterations, float fitness, float inlier_ratio) {
+          feedback.iterations = iterations;
+          feedback.best_fitness = fitness;
+          feedback.best_inlier_ratio = inlier_ratio;
+          estimate_pose_as_->publishFeedback(feedback);
+          return ros::ok() && !estimate_pose_as_->isPreemptRequested();
+        });
+  }
+
+  if (estimate_pose_as_->isPreemptRequested() || !ros::ok()) {
+    ROS_INFO("HoPE Action: Estimate object pose preempted.");
+    action_result.result_status = action_result.PREEMPTED;
+    estimate_pose_as_->setPreempted(action_result);
+    return;
+  }
+  if (!ok) {
+    estimate_pose_as_->setAborted(action_result);
+    return;
+  }
+
+  if (!cached) addToCache(result);
+  action_result.result_status = action_result.SUCCEEDED;
+  action_result.obj_poses = result.poses;
+  action_result.categories = result.categories;
+  action_result.fitness = result.fitness;
+  on_plane_obj_puber_.publish(result.poses);
+  estimate_pose_as_->setSucceeded(action_result);
+}
+
 void PlaneSegmentRT::computeNormalAndFilter()
 {
   Utilities::estimateNorm(src_dsp_mono_, src_normals_, 1.01 * th_grid_rsl_);
@@ -883,6 +1194,7 @@ void PlaneSegmentRT::reset()
 {
   max_plane_cloud_.reset(new PointCloudMono);
   max_plane_contour_.reset(new PointCloudMono);
+  max_plane_grid_.clear();
 
   plane_z_values_.clear();
   seed_clusters_indices_.clear();
@@ -897,68 +1209,231 @@ void PlaneSegmentRT::getMeanZofEachCluster(PointCloudMono::Ptr cloud_norm_fit_mo
     ROS_WARN("PlaneSegment: Z growing got nothing.");
 
   else {
-    size_t k = 0;
-    // Traverse each part to determine its mean Z value
+    // Traverse each part to determine its mean Z value, the points are accessed
+    // by index so that no cloud is extracted for the hypotheses
     for (const auto & seed_clusters_indice : seed_clusters_indices_) {
-      PointCloudMono::Ptr cloud_fit_part(new PointCloudMono);
-
-      pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
-      idx_seed->indices = seed_clusters_indice.indices;
-      Utilities::getCloudByInliers(cloud_norm_fit_mono, cloud_fit_part, idx_seed, false, false);
-
-      float z_mean, z_max, z_min, z_mid;
-      Utilities::getCloudZInfo<PointCloudMono::Ptr>(cloud_fit_part, z_mean, z_max, z_min, z_mid);
-      plane_z_values_.push_back(z_mean);
-      k++;
+      float z_sum = 0;
+      for (int i : seed_clusters_indice.indices) {
+        z_sum += cloud_norm_fit_mono->points[i].z;
+      }
+      plane_z_values_.push_back(z_sum / seed_clusters_indice.indices.size());
     }
 
     ROS_DEBUG("Hypothesis plane number: %d", int(plane_z_values_.size()));
-    // Z is ordered from small to large, i.e., low to high
-    //sort(planeZVector_.begin(), planeZVector_.end());
   }
 }
 
 void PlaneSegmentRT::extractPlaneForEachZ(PointCloudMono::Ptr cloud_norm_fit)
 {
-  size_t id = 0;
-  for (float & plane_z_value : plane_z_values_) {
-    getPlane(id, plane_z_value, cloud_norm_fit);
-    id++;
+  // Hypotheses within the height range that pass the error test
+  vector<size_t> valid_ids;
+  for (size_t id = 0; id < plane_z_values_.size(); ++id) {
+    float z_in = plane_z_values_[id];
+    if (z_in > min_height_ && z_in < max_height_ && gaussianImageAnalysis(id)) {
+      valid_ids.push_back(id);
+    }
+  }
+  if (valid_ids.empty()) return;
+
+  vector<vector<size_t> > groups;
+  mergeHypotheses(valid_ids, groups);
+
+  // All planes in the height range are fused into the map, not only the max one
+  double stamp = ros::Time::now().toSec();
+  for (const auto & group : groups) {
+    map_indices_.clear();
+    float z_sum = 0;
+    for (size_t id : group) {
+      const vector<int> &indices = seed_clusters_indices_[id].indices;
+      map_indices_.insert(map_indices_.end(), indices.begin(), indices.end());
+      z_sum += plane_z_values_[id] * indices.size();
+    }
+    if (map_indices_.empty()) continue;
+    plane_map_.integrate(cloud_norm_fit, map_indices_, z_sum / map_indices_.size(), stamp);
+  }
+
+  // Only the group with the most points is extracted as the max plane
+  size_t max_group = 0;
+  size_t max_num = 0;
+  for (size_t g = 0; g < groups.size(); ++g) {
+    size_t num = 0;
+    for (size_t id : groups[g]) {
+      num += seed_clusters_indices_[id].indices.size();
+    }
+    if (num > max_num) {
+      max_num = num;
+      max_group = g;
+    }
   }
+  getPlane(groups[max_group], cloud_norm_fit);
 }
 
-void PlaneSegmentRT::getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono)
+void PlaneSegmentRT::mergeHypotheses(const vector<size_t> &ids, vector<vector<size_t> > &groups)
 {
-  if (z_in > min_height_ && z_in < max_height_) {
-    pcl::PointIndices::Ptr idx_seed(new pcl::PointIndices);
-    idx_seed->indices = seed_clusters_indices_[id].indices;
-
-    // Extract the plane points indexed by idx_seed
-    PointCloudMono::Ptr cloud_z(new PointCloudMono);
-    Utilities::getCloudByInliers(cloud_norm_fit_mono, cloud_z, idx_seed, false, false);
-
-    // If the points do not pass the error test, return
-    if (!gaussianImageAnalysis(id)) return;
-
-    if (aggressive_merge_) {
-      if (Utilities::isPointCloudValid(max_plane_cloud_)) {
-        if (fabs(max_plane_z_ - z_in) <= th_z_rsl_) {
-          PointCloudMono::Ptr cloud_combined(new PointCloudMono);
-          Utilities::combineCloud(cloud_z, max_plane_cloud_, cloud_combined);
-          cloud_z = cloud_combined;
-        }
-      }
+  groups.clear();
+  if (!aggressive_merge_) {
+    for (size_t id : ids) {
+      groups.push_back(vector<size_t>(1, id));
+    }
+    return;
+  }
+
+  // Sweep the hypotheses from low to high, the ones within th_z_rsl_ above the lowest
+  // member of a group are merged into that group. The result is independent of
+  // the order in which Z growing produced the hypotheses.
+  vector<size_t> sorted_ids(ids);
+  sort(sorted_ids.begin(), sorted_ids.end(), [this](size_t a, size_t b) {
+    return plane_z_values_[a] < plane_z_values_[b];
+  });
+
+  float z_base = 0;
+  for (size_t id : sorted_ids) {
+    if (groups.empty() || plane_z_values_[id] - z_base > th_z_rsl_) {
+      groups.push_back(vector<size_t>());
+      z_base = plane_z_values_[id];
     }
+    groups.back().push_back(id);
+  }
+}
+
+void PlaneSegmentRT::getPlane(const vector<size_t> &ids, PointCloudMono::Ptr &cloud_norm_fit_mono)
+{
+  // Gather the indices of all hypotheses in the group, z is weighted by point number
+  pcl::PointIndices::Ptr idx_plane(new pcl::PointIndices);
+  float z_sum = 0;
+  for (size_t id : ids) {
+    const vector<int> &indices = seed_clusters_indices_[id].indices;
+    idx_plane->indices.insert(idx_plane->indices.end(), indices.begin(), indices.end());
+    z_sum += plane_z_values_[id] * indices.size();
+  }
+  if (idx_plane->indices.empty()) return;
+
+  // Extract the plane points indexed by idx_plane
+  PointCloudMono::Ptr cloud_z(new PointCloudMono);
+  Utilities::getCloudByInliers(cloud_norm_fit_mono, cloud_z, idx_plane, false, false);
+
+  // Update the data of the max plane detected
+  max_plane_cloud_ = cloud_z;
+  // Use the traced contour to represent the plane patch
+  computeContour(max_plane_cloud_, max_plane_contour_);
+  max_plane_z_ = z_sum / idx_plane->indices.size();
+  max_plane_points_num_ = cloud_z->points.size();
+}
+
+void PlaneSegmentRT::computeContour(const PointCloudMono::Ptr& cloud, PointCloudMono::Ptr &contour)
+{
+  float z_mean, z_max, z_min, z_mid;
+  Utilities::getCloudZInfo<PointCloudMono::Ptr>(cloud, z_mean, z_max, z_min, z_mid);
+
+  // The grid is kept for verifying the plane in the following frames
+  max_plane_grid_.fromCloud(cloud, th_grid_rsl_);
+  max_plane_grid_.close();
+  // A merged plane may consist of several isolated patches, only the largest one is kept
+  max_plane_grid_.keepLargestComponent();
+  max_plane_grid_.traceContour(contour, z_max, concave_contour_);
+}
+
+void PlaneSegmentRT::updatePlaneMap()
+{
+  size_t pruned = plane_map_.prune(ros::Time::now().toSec(), plane_map_ttl_);
+  if (pruned > 0) {
+    ROS_DEBUG("HoPE: %d stale planes are pruned from the map.", int(pruned));
+  }
+
+  vector<size_t> changed;
+  plane_map_.getChanged(changed);
+  for (size_t id : changed) {
+    if (plane_map_.planes()[id].dropped > 0) {
+      ROS_WARN_THROTTLE(10, "HoPE: Plane at z %.3f in the map is full, %d points are dropped.",
+                        plane_map_.planes()[id].z, int(plane_map_.planes()[id].dropped));
+    }
+    PointCloudMono::Ptr layer(new PointCloudMono);
+    plane_map_.getCells(id, layer);
+    Utilities::publishCloud(layer, plane_map_puber_, base_frame_);
+  }
+}
+
+bool PlaneSegmentRT::getPlaneMapCallback(hope::GetPlaneMap::Request &req,
+                                         hope::GetPlaneMap::Response &res)
+{
+  PointCloudMono::Ptr cells(new PointCloudMono);
+  for (size_t id = 0; id < plane_map_.planes().size(); ++id) {
+    float z = plane_map_.planes()[id].z;
+    if (z < req.min_height || z > req.max_height) continue;
+
+    float min_x, min_y, max_x, max_y;
+    if (!plane_map_.getExtent(id, min_x, min_y, max_x, max_y)) continue;
+    res.z.push_back(z);
+    res.min_x.push_back(min_x);
+    res.min_y.push_back(min_y);
+    res.max_x.push_back(max_x);
+    res.max_y.push_back(max_y);
+    res.area.push_back(plane_map_.getArea(id));
+
+    PointCloudMono::Ptr layer(new PointCloudMono);
+    plane_map_.getCells(id, layer);
+    *cells += *layer;
+  }
+
+  if (res.z.empty()) {
+    ROS_WARN("HoPE Service: No plane in the map within height range %.3f, %.3f.", req.min_height, req.max_height);
+    res.result_status = res.FAILED;
+    return true;
+  }
+  pcl::toROSMsg(*cells, res.points);
+  res.points.header.frame_id = base_frame_;
+  res.points.header.stamp = ros::Time::now();
+  res.result_status = res.SUCCEEDED;
+  return true;
+}
 
-    // Update the data of the max plane detected
-    if (cloud_z->points.size() > max_plane_points_num_) {
-      max_plane_cloud_ = cloud_z;
-      // Use convex hull to represent the plane patch
-      Utilities::computeHull(max_plane_cloud_, max_plane_contour_);
-      max_plane_z_ = z_in;
-      max_plane_points_num_ = cloud_z->points.size();
+bool PlaneSegmentRT::verifyTrackedPlane()
+{
+  if (max_plane_grid_.empty()) return false;
+  // The height range may have been reconfigured
+  if (max_plane_z_ < min_height_ || max_plane_z_ > max_height_) return false;
+
+  verify_hits_.assign(max_plane_grid_.cells_.size(), 0);
+  PointCloudMono::Ptr cloud_z(new PointCloudMono);
+  size_t hit_num = 0;
+  float z_sum = 0;
+  for (const auto & pt : src_mono_cloud_->points) {
+    // Written in this way so that NaN points are skipped as well
+    if (!(fabs(pt.z - max_plane_z_) <= th_track_band_)) continue;
+    int idx = max_plane_grid_.cellIndex(pt.x, pt.y);
+    if (idx < 0 || !max_plane_grid_.cells_[idx]) continue;
+    if (!verify_hits_[idx]) {
+      verify_hits_[idx] = 1;
+      hit_num++;
     }
+    z_sum += pt.z;
+    cloud_z->points.push_back(pt);
   }
+
+  float coverage = float(hit_num) / max_plane_grid_.occupied_num_;
+  if (coverage < th_track_coverage_) {
+    ROS_DEBUG("HoPE: Tracked plane lost, only %.2f of it is observed.", coverage);
+    return false;
+  }
+
+  cloud_z->width = cloud_z->points.size();
+  cloud_z->height = 1;
+  cloud_z->is_dense = true;
+
+  // Low-pass filter the plane z, the contour moves along with it
+  float z_obs = z_sum / cloud_z->points.size();
+  float dz = track_alpha_ * (z_obs - max_plane_z_);
+  for (auto & pt : max_plane_contour_->points) {
+    pt.z += dz;
+  }
+  max_plane_z_ += dz;
+  // Down sample as in the full extraction, so that the plane cloud and its point number
+  // do not depend on whether the frame is tracked
+  PointCloudMono::Ptr cloud_dsp(new PointCloudMono);
+  Utilities::downSampling(cloud_z, cloud_dsp, th_grid_rsl_, th_z_rsl_);
+  max_plane_cloud_ = cloud_dsp;
+  max_plane_points_num_ = cloud_dsp->points.size();
+  return true;
 }
 
 void PlaneSegmentRT::zClustering(const PointCloudMono::Ptr& cloud_norm_fit_mono)
@@ -1061,70 +1536,182 @@ bool PlaneSegmentRT::gaussianImageAnalysis(size_t id)
   return Utilities::normalAnalysis(cluster_normal, th_angle_);
 }
 
-bool PlaneSegmentRT::postProcessing(bool do_cluster, string type) {
-  if (Utilities::isPointCloudValid(max_plane_contour_)) {
-    vector<PointCloudMono::Ptr> clusters;
-    if (do_cluster) {
-      bool ok = Utilities::getClustersUponPlane(src_mono_cloud_, max_plane_contour_, clusters);
-      ROS_INFO("HoPE: Object clusters on plane #: %d", int(clusters.size()));
-      if (!ok) return false;
+bool PlaneSegmentRT::lockEstimator(boost::mutex::scoped_lock &lock, bool wait)
+{
+  if (wait) {
+    lock.lock();
+    return true;
+  }
+  if (lock.try_lock()) return true;
+  ROS_WARN("HoPE: Pose estimator is busy with another request.");
+  return false;
+}
+
+bool PlaneSegmentRT::postProcessing(const FrameSnapshot &frame, const ObjectQuery &query, ObjectResult &result,
+                                    bool wait) {
+  vector<PointCloudMono::Ptr> clusters;
+  if (!getObjectClusters(frame, query.do_cluster, clusters)) {
+    result.stamp = frame.stamp;
+    result.query = query;
+    result.ok = false;
+    result.poses.poses.clear();
+    result.categories.clear();
+    result.fitness = FLT_MAX;
+    result.busy = false;
+    return false;
+  }
+  return estimateObjectPoses(frame, query, clusters, result, AlignmentProgress(), wait);
+}
+
+bool PlaneSegmentRT::getObjectClusters(const FrameSnapshot &frame, bool do_cluster,
+                                       vector<PointCloudMono::Ptr> &clusters) {
+  clusters.clear();
+  if (!Utilities::isPointCloudValid(frame.contour)) {
+    ROS_WARN("HoPE: No valid plane for extracting objects on top.");
+    return false;
+  }
+
+  if (do_cluster) {
+    bool ok;
+    if (frame.organized_cloud->height > 1) {
+      ok = Utilities::getClustersUponPlaneOrganized(frame.organized_cloud, frame.contour, clusters, th_grid_rsl_);
     } else {
-      pcl::PointIndices::Ptr indices(new pcl::PointIndices);
-      PointCloudMono::Ptr upper_cloud(new PointCloudMono);
-      Utilities::getCloudByZ(src_mono_cloud_, indices, upper_cloud, max_plane_z_ + 0.05f, 1000.0f);
-      if (!Utilities::isPointCloudValid(upper_cloud)) {
-        ROS_WARN("HoPE: No point cloud on the max plane.");
-        return false;
-      }
-      clusters.push_back(upper_cloud);
+      ok = Utilities::getClustersUponPlane(frame.cloud, frame.contour, clusters, th_grid_rsl_);
     }
+    ROS_INFO("HoPE: Object clusters on plane #: %d", int(clusters.size()));
+    return ok;
+  } else {
+    pcl::PointIndices::Ptr indices(new pcl::PointIndices);
+    PointCloudMono::Ptr upper_cloud(new PointCloudMono);
+    // Keep a margin of one grid cell only, a higher cut removes the lower part of short objects
+    // and leaves too few points for aligning a mesh model
+    Utilities::getCloudByZ(frame.cloud, indices, upper_cloud, frame.plane_z + th_grid_rsl_, 1000.0f);
+    if (!Utilities::isPointCloudValid(upper_cloud)) {
+      ROS_WARN("HoPE: No point cloud on the max plane.");
+      return false;
+    }
+    clusters.push_back(upper_cloud);
+    return true;
+  }
+}
 
-    on_top_object_poses_.poses.clear();
-    on_top_object_categories_.clear();
-    
-    if (type != "mesh") {
-      for (auto & cloud : clusters) {
-        geometry_msgs::Pose pose;
+bool PlaneSegmentRT::estimateObjectPoses(const FrameSnapshot &frame, const ObjectQuery &query,
+                                         const vector<PointCloudMono::Ptr> &clusters, ObjectResult &result,
+                                         const AlignmentProgress &progress, bool wait) {
+  result.stamp = frame.stamp;
+  result.query = query;
+  result.ok = false;
+  result.poses.poses.clear();
+  result.categories.clear();
+  result.fitness = FLT_MAX;
+  result.busy = false;
+  const string &type = query.type;
+
+  if (clusters.empty()) return false;
+
+  if (type != "mesh") {
+    if (type != "cylinder" && type != "box" && type != "box_top") {
+      ROS_WARN("HoPE: Unknown object type %s", type.c_str());
+      return false;
+    }
+
+    // Each object writes to its own slot, so the output order is the same as the
+    // order of clusters regardless of the thread scheduling
+    int num = int(clusters.size());
+    vector<geometry_msgs::Pose> poses(num);
+    vector<int> categories(num, -1);
+    vector<uint8_t> valid(num, 0);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num; ++i) {
+      // Exceptions must not escape the parallel region
+      try {
+        bool ok;
         if (type == "cylinder") {
-          bool ok = Utilities::getCylinderPose(cloud, pose, origin_height_);
-          if (!ok) continue;
+          ok = Utilities::getCylinderPose(clusters[i], poses[i], query.origin_height);
         } else if (type == "box") {
-          try {
-            bool ok = Utilities::getBoxPose(cloud, pose, origin_height_);
-            if (!ok) continue;
-          } catch (cv::Exception) {
-            ROS_WARN("HoPE: Exception raised during getting box pose");
-            continue;
-          }
-        } else if (type == "box_top") {
-          try {
-            int category;
-            bool ok = Utilities::getBoxTopPose(cloud, pose, category, origin_heights_);
-            if (!ok) continue;
-            on_top_object_categories_.push_back(category);
-          } catch (cv::Exception) {
-            ROS_WARN("HoPE: Exception raised during getting box pose");
-            continue;
-          }
+          ok = Utilities::getBoxPose(clusters[i], poses[i], query.origin_height);
         } else {
-          ROS_WARN("HoPE: Unknown object type %s", type.c_str());
-          return false;
+          ok = Utilities::getBoxTopPose(clusters[i], poses[i], categories[i], query.origin_heights);
         }
-        on_top_object_poses_.poses.push_back(pose);
+        valid[i] = ok ? 1 : 0;
+      } catch (const std::exception &e) {
+        ROS_WARN("HoPE: Exception raised during getting %s pose: %s", type.c_str(), e.what());
       }
-    } else {
+    }
+
+    for (int i = 0; i < num; ++i) {
+      if (!valid[i]) continue;
+      result.poses.poses.push_back(poses[i]);
+      if (type == "box_top") result.categories.push_back(categories[i]);
+    }
+  } else if (query.do_cluster) {
+    result.fitness = 0;
+    vector<string> paths;
+    boost::split(paths, query.mesh_path, boost::is_any_of(","));
+    for (auto & path : paths) boost::trim(path);
+    paths.erase(remove(paths.begin(), paths.end(), string()), paths.end());
+    for (const auto & cluster : clusters) {
       PointCloudN::Ptr scene_cloud(new PointCloudN);
-      Utilities::convertCloudType(clusters[0], scene_cloud);
+      Utilities::convertCloudType(cluster, scene_cloud);
       Eigen::Matrix4f trans;
-      pe_->estimate(scene_cloud, trans);
-      Utilities::matrixToPoseArray(trans, on_top_object_poses_);
+      int model_id;
+      bool ok;
+      bool cancelled;
+      float fitness;
+      {
+        boost::mutex::scoped_lock lock(pe_mutex_, boost::defer_lock);
+        if (!lockEstimator(lock, wait)) {
+          result.busy = true;
+          return false;
+        }
+        pe_->setProgressCallback(progress);
+        ok = pe_->recognize(paths, scene_cloud, frame.plane_z, model_id, trans);
+        pe_->setProgressCallback(AlignmentProgress());
+        cancelled = pe_->isCancelled();
+        fitness = pe_->getFitness();
+      }
+      // The remaining clusters are skipped once the request is cancelled
+      if (cancelled) return false;
+      if (!ok) continue;
+      result.fitness = std::max(result.fitness, fitness);
+      Utilities::matrixToPoseArray(trans, result.poses);
+      result.categories.push_back(model_id);
+    }
+    if (result.poses.poses.empty()) {
+      ROS_WARN("HoPE: No object model is recognized.");
+      return false;
     }
-    on_top_object_poses_.header.stamp = ros::Time::now();
-    on_top_object_poses_.header.frame_id = base_frame_;
-    on_plane_obj_puber_.publish(on_top_object_poses_);
-    return true;
   } else {
-    ROS_WARN("HoPE: No valid plane for extracting objects on top.");
-    return false;
+    PointCloudN::Ptr scene_cloud(new PointCloudN);
+    Utilities::convertCloudType(clusters[0], scene_cloud);
+    Eigen::Matrix4f trans;
+    {
+      // The pose estimator is shared by the services and the action
+      boost::mutex::scoped_lock lock(pe_mutex_, boost::defer_lock);
+      if (!lockEstimator(lock, wait)) {
+        result.busy = true;
+        return false;
+      }
+      if (!query.mesh_path.empty() && !pe_->setObjectModel(query.mesh_path)) {
+        ROS_WARN("HoPE: Object model %s is not available.", query.mesh_path.c_str());
+        return false;
+      }
+      // The object stands on the max plane, so only its yaw and xy are unknown
+      pe_->setDescriptor(gravity_descriptor_ ? PoseEstimation::GRAVITY : PoseEstimation::FPFH);
+      pe_->setProgressCallback(progress);
+      bool ok = pe_->estimateOnPlane(scene_cloud, frame.plane_z, trans);
+      pe_->setProgressCallback(AlignmentProgress());
+      if (!ok) {
+        ROS_WARN("HoPE: Pose estimation of the object model failed.");
+        return false;
+      }
+      result.fitness = pe_->getFitness();
+    }
+    Utilities::matrixToPoseArray(trans, result.poses);
   }
+  result.poses.header.stamp = ros::Time::now();
+  result.poses.header.frame_id = base_frame_;
+  result.ok = true;
+  return true;
 }
@@ -26,6 +26,11 @@
 #include <dynamic_reconfigure/server.h>
 #include <hope/hopeConfig.h>
 #include <hope/ExtractObjectOnTop.h>
+#include <hope/ExtractObjectsOnTop.h>
+#include <hope/EstimateObjectPoseAction.h>
+
+#include <actionlib/server/simple_action_server.h>
+#include <hope/GetPlaneMap.h>
 
 // PCL
 #include <pcl/common/common.h>
@@ -68,11 +73,16 @@
 
 #include <pcl/visualization/pcl_visualizer.h>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/algorithm/string.hpp>
 
 // STL
 #include <math.h>
 #include <vector>
 #include <string>
+#include <deque>
+#include <atomic>
 
 // OpenCV
 #include <opencv2/imgproc/imgproc.hpp>
@@ -84,31 +94,33 @@
 #include "transform.h"
 #include "utilities.h"
 #include "pose_estimation.h"
+#include "occupancy_grid.h"
+#include "plane_tracker.h"
+#include "plane_map.h"
 
 
 enum data_type{SYN, POINT_CLOUD, TUM_SINGLE, TUM_LIST};
 
-class HopeResult
+/**
+ * Compact record of an extracted plane. The plane points are not kept in a cloud
+ * of their own, but in a range of the frame buffer shared by all planes in a frame.
+ */
+struct PlaneRecord
 {
-public:
-  HopeResult();
-  
-  /// Container for storing final results
-  vector<PointCloud::Ptr> plane_results_;
-  vector<PointCloud::Ptr> plane_points_;
-  vector<PointCloud::Ptr> plane_hull_;
-  vector<pcl::PolygonMesh> plane_mesh_;
-  vector<vector<float> > plane_params_; // z area
-  
-  /// Container for storing the largest plane
-  PointCloud::Ptr plane_max_result_;
-  PointCloud::Ptr plane_max_points_;
-  PointCloud::Ptr plane_max_hull_;
-  pcl::PolygonMesh plane_max_mesh_;
-  vector<float> plane_max_param_;
-  
-  /// Container of plane id
-  
+  // Index range [begin, end) of the plane points in the frame buffer
+  size_t begin;
+  size_t end;
+  // Mean z value
+  float z;
+  // Bounding rect in XY plane
+  float min_x;
+  float min_y;
+  float max_x;
+  float max_y;
+  // Area covered by the plane points, measured by occupied cells of the XY grid
+  float area;
+
+  inline size_t size() const { return end - begin; }
 };
 
 class PlaneSegment
@@ -127,24 +139,28 @@ public:
   void getHorizontalPlanes(PointCloud::Ptr cloud);
   
   /// Container for storing final results
-  vector<PointCloud::Ptr> plane_results_;
-  vector<PointCloudMono::Ptr> plane_points_;
-  // Optional
-  vector<PointCloud::Ptr> plane_hull_;
-  vector<pcl::PolygonMesh> plane_mesh_;
-  vector<vector<float> > plane_coeff_;
+  vector<PlaneRecord> plane_records_;
+  // Frame buffer holding the points of all planes in plane_records_
+  PointCloudMono::Ptr plane_buffer_;
 
-  /// Container for storing the largest plane
-  PointCloud::Ptr plane_max_result_;
-  PointCloudMono::Ptr plane_max_points_;
-  PointCloud::Ptr plane_max_hull_;
-  pcl::PolygonMesh plane_max_mesh_;
-  vector<float> plane_max_coeff_;  
+  /// Materialize the results of the plane with given index in plane_records_ on request
+  PointCloudMono::Ptr getPlanePoints(size_t i) const;
+  void getPlaneHull(size_t i, PointCloudMono::Ptr &hull, pcl::PolygonMesh &mesh) const;
+  // Render the plane points with their z error towards the plane
+  void getPlaneError(size_t i, PointCloud::Ptr &cloud_err) const;
 
   void setRPY(float roll, float pitch, float yaw);
   void setQ(float qx, float qy, float qz, float qw);
   void setT(float tx, float ty, float tz);
 
+  /**
+   * Set the gate of plane ID tracking between frames. The feature of a plane is its mean z
+   * and XY bounding rect, so the gate is the summed change in meter of these five values.
+   * Larger gates keep the IDs of large or distant planes whose bounds jitter more.
+   * @param gate Max L1 distance in meter, default th_id_gate_
+   */
+  void setIDGate(float gate);
+
 protected:
   data_type type_;
 
@@ -164,8 +180,9 @@ private:
   
   /// Supporting surface point number threshold
   int global_size_temp_;
-  vector<vector<float> > global_coeff_temp_;
   vector<int> global_id_temp_;
+  // Flat feature array of the planes in current frame, reused between frames
+  vector<float> plane_features_;
   
   /// ROS stuff
   ros::NodeHandle nh_;
@@ -200,6 +217,8 @@ private:
   /// Tool objects
   Transform *tf_;
   HighResTimer hst_;
+  OccupancyGrid grid_;
+  PlaneTracker tracker_;
   boost::shared_ptr<pcl::visualization::PCLVisualizer> viewer;
 
   void computeNormalAndFilter();
@@ -216,7 +235,6 @@ private:
   void zClustering(PointCloudMono::Ptr cloud_norm_fit_mono);
   void getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono);
   bool gaussianImageAnalysis(size_t id);
-  int  checkSimilar(vector<float> coeff);
   void setID();
 
   /**
@@ -233,8 +251,72 @@ private:
   pcl::PolygonMesh mesh(const PointCloudMono::Ptr point_cloud, CloudN::Ptr normals);
   
   void visualizeProcess(PointCloud::Ptr cloud);
-  void setFeatures(float z_in, PointCloudMono::Ptr cluster);
-  void computeHull(PointCloud::Ptr cluster_2d_rgb);
+
+  /**
+   * Append the points of a plane into the frame buffer and record its features.
+   * @param cloud Cloud containing the plane points
+   * @param indices Indices of the plane points in cloud
+   */
+  void addPlane(const PointCloudMono::Ptr& cloud, const vector<int> &indices);
+};
+
+/**
+ * Parameters of an extract_object_on_top request that affect its result.
+ */
+struct ObjectQuery
+{
+  // Could be cylinder; box; box_top; mesh
+  string type;
+  // Whether divide upper cloud into clusters
+  bool do_cluster;
+  // The height of the object origin w.r.t. the base. This origin may not coincide
+  // with the mass centroid of the object, only used to infer its pose or ease
+  // the manipulation as it should be fixed with the object body.
+  float origin_height;
+  // Heights of the boxes, only used for box_top
+  vector<double> origin_heights;
+  // Object pcd file path, only used for mesh
+  string mesh_path;
+
+  inline bool operator==(const ObjectQuery &q) const
+  {
+    return type == q.type && do_cluster == q.do_cluster && origin_height == q.origin_height &&
+           origin_heights == q.origin_heights && mesh_path == q.mesh_path;
+  }
+};
+
+/**
+ * Data of one frame used for extracting the objects on the max plane. The clouds are
+ * not modified once the snapshot is taken, so that it could be shared between threads.
+ */
+struct FrameSnapshot
+{
+  // Stamp of the source cloud
+  ros::Time stamp;
+  PointCloudMono::Ptr cloud;
+  // Empty if the source is not organized or the organized segmentation is disabled
+  PointCloudMono::Ptr organized_cloud;
+  PointCloudMono::Ptr contour;
+  float plane_z;
+  // Whether the planes of this frame are aggressively merged
+  bool aggressive_merge;
+};
+
+/**
+ * Objects extracted from a frame for a query.
+ */
+struct ObjectResult
+{
+  // Stamp of the source cloud
+  ros::Time stamp;
+  ObjectQuery query;
+  bool ok;
+  geometry_msgs::PoseArray poses;
+  vector<int> categories;
+  // Fitness score of the mesh poses, the worst one if there are multiple
+  float fitness;
+  // The query was not run since the pose estimator was in use by another request
+  bool busy;
 };
 
 /**
@@ -255,24 +337,31 @@ public:
   PlaneSegmentRT(float th_xy, float th_z, ros::NodeHandle nh,
     string base_frame = "", const string& cloud_topic = "");
 
-  ~PlaneSegmentRT() = default;
+  ~PlaneSegmentRT();
 
-  // If aggressively merge all planes with same height to one
+  // If aggressively merge all planes with same height to one, only used by the
+  // extraction thread and updated from merge_request_ before each frame
   bool aggressive_merge_;
+  // If represent the max plane with concave contour rather than convex hull
+  bool concave_contour_;
+  // If verify the max plane tracked from previous frames before running full extraction
+  bool enable_tracking_;
+  // Max number of frames reusing the tracked max plane before a full extraction
+  int refresh_interval_;
+  // Planes in the map not observed within this period in second are pruned
+  double plane_map_ttl_;
+  // If segment the objects on the plane in image space when the source cloud is organized
+  bool organized_segment_;
   void getHorizontalPlanes();
 
+  /// Preprocess the object models for mesh pose estimation in advance
+  void preloadObjectModels(const vector<string> &paths);
+
   /// Container for storing the largest plane
   PointCloudMono::Ptr max_plane_cloud_;
   PointCloudMono::Ptr max_plane_contour_;
   float max_plane_z_;
 
-  // The height of the object origin w.r.t. the base. This origin may not coincide
-  // with the mass centroid of the object, only used to infer its pose or ease
-  // the manipulation as it should be fixed with the object body.
-  float origin_height_;
-
-  std::vector<double> origin_heights_;
-
   // Extracted objects' pose
   geometry_msgs::PoseArray on_top_object_poses_;
 
@@ -292,17 +381,38 @@ private:
   ros::NodeHandle nh_;
   dynamic_reconfigure::Server<hope::hopeConfig> server_;
   ros::ServiceServer extract_on_top_server_;
+  ros::ServiceServer plane_map_server_;
+  ros::ServiceServer extract_objects_on_top_server_;
+
+  // Mesh pose estimation runs in the thread of the action server, so that it
+  // does not block getHorizontalPlanes and could be preempted
+  actionlib::SimpleActionServer<hope::EstimateObjectPoseAction> *estimate_pose_as_;
 
   ros::Subscriber source_suber;
   void cloudCallback(const sensor_msgs::PointCloud2ConstPtr &cloud_msg);
   void configCallback(hope::hopeConfig &config, uint32_t level);
   bool extractOnTopCallback(hope::ExtractObjectOnTop::Request &req,
                             hope::ExtractObjectOnTop::Response &res);
+  bool getPlaneMapCallback(hope::GetPlaneMap::Request &req,
+                           hope::GetPlaneMap::Response &res);
+  bool extractObjectsOnTopCallback(hope::ExtractObjectsOnTop::Request &req,
+                                   hope::ExtractObjectsOnTop::Response &res);
+
+  void estimatePoseExecuteCallback(const hope::EstimateObjectPoseGoalConstPtr &goal);
+
+  /**
+   * Fill the query with the parameters of a request for one object type.
+   * @param id Object type, could be cylinder; box; box_top; mesh; debug
+   * @return False if the type is unknown
+   */
+  bool makeQuery(const string &id, float origin_height, const vector<double> &origin_heights,
+                 const string &mesh_path, ObjectQuery &query);
 
   ros::Publisher plane_cloud_puber_;
   ros::Publisher max_plane_puber_;
   ros::Publisher max_contour_puber_;
   ros::Publisher on_plane_obj_puber_;
+  ros::Publisher plane_map_puber_;
 
   void getSourceCloud();
 
@@ -312,6 +422,10 @@ private:
 
   // Source point cloud
   PointCloudMono::Ptr src_mono_cloud_;
+  ros::Time src_stamp_;
+  // Source point cloud in base frame keeping the organization of the raw cloud, pixels
+  // out of the depth range are NaN. Empty if the raw cloud is not organized.
+  PointCloudMono::Ptr src_organized_cloud_;
 
   // Source cloud after down sampling
   PointCloudMono::Ptr src_dsp_mono_;
@@ -332,9 +446,49 @@ private:
   Transform *tf_;
   HighResTimer hst_;
   PoseEstimation *pe_;
-
-  // object pcd file path, used when detect mesh type object
-  string object_model_path_;
+  boost::mutex pe_mutex_;
+  // Set by dynamic reconfigure and applied to pe_ before each estimation, so that the
+  // callback never waits for a running alignment
+  std::atomic<bool> gravity_descriptor_;
+
+  /// Tracking state of the max plane
+  // Occupancy of the max plane in XY, used to verify it in the following frames
+  OccupancyGrid max_plane_grid_;
+  // Frames passed since last full extraction
+  int frames_since_refresh_;
+  // Cells of max_plane_grid_ observed in current frame, reused between frames
+  vector<uint8_t> verify_hits_;
+
+  // Horizontal planes fused over frames in the base frame
+  PlaneMap plane_map_;
+  vector<int> map_indices_;
+
+  /// Asynchronous extraction of the objects on the max plane
+  // Worker extracting the objects of each new frame for the last query
+  boost::thread worker_;
+  // Guard all members in this group
+  boost::mutex cache_mutex_;
+  boost::condition_variable frame_cond_;
+  FrameSnapshot latest_frame_;
+  bool new_frame_;
+  ObjectQuery last_query_;
+  bool has_query_;
+  // Merge mode of the last request, applied from the next frame on
+  bool merge_request_;
+  // Time of the last request, the query is dropped if no request comes for a while
+  ros::WallTime last_query_time_;
+  bool stop_worker_;
+  // Results of recent frames and queries, the newest at the back
+  std::deque<ObjectResult> cache_;
+
+  /// Take a snapshot of current frame and wake up the worker
+  void updateSnapshot();
+
+  /// Request the merge mode of the planes for the following frames, thread safe
+  void requestMergeMode(bool aggressive_merge);
+  void precomputeLoop();
+  bool findInCache(const ros::Time &stamp, const ObjectQuery &query, ObjectResult &result);
+  void addToCache(const ObjectResult &result);
 
   void computeNormalAndFilter();
 
@@ -346,19 +500,69 @@ private:
   void getMeanZofEachCluster(PointCloudMono::Ptr cloud_norm_fit_mono);
   void extractPlaneForEachZ(PointCloudMono::Ptr cloud_norm_fit);
   void zClustering(const PointCloudMono::Ptr& cloud_norm_fit_mono);
-  void getPlane(size_t id, float z_in, PointCloudMono::Ptr &cloud_norm_fit_mono);
+
+  /**
+   * Group the plane hypotheses by their mean z. If aggressive_merge_ is true, hypotheses
+   * within th_z_rsl_ are merged by a sweep over the sorted z values, otherwise each
+   * hypothesis forms its own group. Only indices are handled here.
+   * @param ids Ids of the valid hypotheses in seed_clusters_indices_
+   * @param groups Ids of the hypotheses in each group
+   */
+  void mergeHypotheses(const vector<size_t> &ids, vector<vector<size_t> > &groups);
+
+  /// Extract the points of a group of hypotheses as the max plane
+  void getPlane(const vector<size_t> &ids, PointCloudMono::Ptr &cloud_norm_fit_mono);
   bool gaussianImageAnalysis(size_t id);
 
   void visualizeResult();
 
   /**
    * In the real time mode, we could extract the clusters on top of the max
-   * plane with this function.
-   * @param type Geometric type of the object, could be cylinder; box; mesh.
-   * @param do_cluster Whether divide upper cloud into clusters.
+   * plane with this function. It only reads the given frame and could be called
+   * from the worker thread.
+   * @param frame Snapshot of the frame to extract the objects from
+   * @param query Type of the objects and related parameters
+   * @param result Output objects' poses and categories
+   * @param wait Whether to wait for the pose estimator if it is in use, otherwise
+   * result.busy is set and false is returned
+   */
+  bool postProcessing(const FrameSnapshot &frame, const ObjectQuery &query, ObjectResult &result,
+                      bool wait = true);
+
+  /// Lock pe_mutex_ with the deferred lock, return false if wait is false and it is in use
+  bool lockEstimator(boost::mutex::scoped_lock &lock, bool wait);
+
+  /// Get the clusters on the max plane, or all points above it if do_cluster is false
+  bool getObjectClusters(const FrameSnapshot &frame, bool do_cluster, vector<PointCloudMono::Ptr> &clusters);
+
+  /**
+   * Estimate the poses of the objects in the clusters for the query.
+   * @param progress Progress callback of the mesh alignment, could be empty
+   * @param wait Same as in postProcessing
+   */
+  bool estimateObjectPoses(const FrameSnapshot &frame, const ObjectQuery &query,
+                           const vector<PointCloudMono::Ptr> &clusters, ObjectResult &result,
+                           const AlignmentProgress &progress = AlignmentProgress(), bool wait = true);
+
+  /**
+   * Rasterize the plane points into the XY grid with resolution th_grid_rsl_ and trace
+   * the boundary of the occupied cells as the contour of the plane.
+   * @param cloud Plane points
+   * @param contour Ordered contour vertices, with z equals to the max z of the plane
    */
-  bool postProcessing(bool do_cluster, string type);
-  void computeHull(PointCloudMono::Ptr cluster_2d, PointCloudMono::Ptr &cluster_hull);
+  void computeContour(const PointCloudMono::Ptr& cloud, PointCloudMono::Ptr &contour);
+
+  /**
+   * Verify the tracked max plane with the source cloud instead of extracting it again.
+   * Points within a z band around the plane are counted in max_plane_grid_, if enough
+   * cells are observed, the plane z is updated with a low-pass filter and the max plane
+   * cloud is replaced by the points in the band.
+   * @return False if no plane is tracked or the tracked one could not be verified
+   */
+  bool verifyTrackedPlane();
+
+  /// Prune the stale planes in the map and publish the layers changed in this frame
+  void updatePlaneMap();
 };
 
 #endif // PLANE_SEGMENT_H
@@ -0,0 +1,83 @@
+#include "plane_tracker.h"
+
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+using namespace std;
+
+PlaneTracker::PlaneTracker(size_t feature_dim, float gate) :
+  feature_dim_(feature_dim),
+  gate_(gate),
+  next_id_(0)
+{
+}
+
+void PlaneTracker::reset()
+{
+  track_features_.clear();
+  track_ids_.clear();
+  free_ids_.clear();
+  next_id_ = 0;
+}
+
+int PlaneTracker::acquireID()
+{
+  if (free_ids_.empty()) return next_id_++;
+  pop_heap(free_ids_.begin(), free_ids_.end(), greater<int>());
+  int id = free_ids_.back();
+  free_ids_.pop_back();
+  return id;
+}
+
+void PlaneTracker::releaseID(int id)
+{
+  free_ids_.push_back(id);
+  push_heap(free_ids_.begin(), free_ids_.end(), greater<int>());
+}
+
+void PlaneTracker::update(const vector<float> &features, vector<int> &ids)
+{
+  size_t plane_num = features.size() / feature_dim_;
+  size_t track_num = track_ids_.size();
+
+  // Collect all pairs within the gate
+  candidates_.clear();
+  for (size_t t = 0; t < track_num; ++t) {
+    const float *ft = &track_features_[t * feature_dim_];
+    for (size_t p = 0; p < plane_num; ++p) {
+      const float *fp = &features[p * feature_dim_];
+      float dis = 0;
+      for (size_t d = 0; d < feature_dim_; ++d) {
+        dis += fabs(ft[d] - fp[d]);
+      }
+      if (dis < gate_) {
+        candidates_.emplace_back(dis, make_pair(int(t), int(p)));
+      }
+    }
+  }
+
+  // Greedy assignment from the closest pair, each track and plane can only be used once
+  sort(candidates_.begin(), candidates_.end());
+  ids.assign(plane_num, -1);
+  track_to_plane_.assign(track_num, -1);
+  for (const auto & c : candidates_) {
+    int t = c.second.first;
+    int p = c.second.second;
+    if (track_to_plane_[t] >= 0 || ids[p] >= 0) continue;
+    track_to_plane_[t] = p;
+    ids[p] = track_ids_[t];
+  }
+
+  // IDs of lost tracks are released before the new planes take theirs
+  for (size_t t = 0; t < track_num; ++t) {
+    if (track_to_plane_[t] < 0) releaseID(track_ids_[t]);
+  }
+  for (size_t p = 0; p < plane_num; ++p) {
+    if (ids[p] < 0) ids[p] = acquireID();
+  }
+
+  // Current planes become the tracks for the next frame
+  track_features_.assign(features.begin(), features.begin() + plane_num * feature_dim_);
+  track_ids_.assign(ids.begin(), ids.end());
+}
@@ -0,0 +1,60 @@
+#ifndef PLANE_TRACKER_H
+#define PLANE_TRACKER_H
+
+// STL
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+
+/**
+ * Keep the IDs of planes consistent between frames. There are usually only a dozen
+ * planes in a frame, so the planes are matched by gated greedy assignment on the
+ * pairwise L1 distance of their features, which needs no index and no normalization.
+ * All buffers are members and are reused, so no allocation happens once warmed up.
+ */
+class PlaneTracker
+{
+public:
+  /**
+   * @param feature_dim Dimension of the feature of each plane
+   * @param gate Max L1 distance in meter between two features regarded as the same plane
+   */
+  PlaneTracker(size_t feature_dim, float gate);
+
+  /**
+   * Match the planes of current frame with those of the previous frame. Matched planes
+   * inherit the previous IDs, unmatched ones get the smallest IDs not in use.
+   * @param features Features of current planes, stored in a flat array row by row
+   * @param ids Output IDs of current planes
+   */
+  void update(const std::vector<float> &features, std::vector<int> &ids);
+
+  /// Drop all tracks and make all IDs available
+  void reset();
+
+  /// Set the max L1 distance in meter between two features regarded as the same plane
+  inline void setGate(float gate) { gate_ = gate; }
+
+private:
+  size_t feature_dim_;
+  float gate_;
+
+  // Features and IDs of the tracked planes of the previous frame
+  std::vector<float> track_features_;
+  std::vector<int> track_ids_;
+
+  // Released IDs kept in a min heap, IDs not less than next_id_ are never used
+  std::vector<int> free_ids_;
+  int next_id_;
+
+  /// Reused buffers
+  // Distance and (track, plane) index pairs passing the gate
+  std::vector<std::pair<float, std::pair<int, int> > > candidates_;
+  std::vector<int> track_to_plane_;
+
+  int acquireID();
+  void releaseID(int id);
+};
+
+#endif // PLANE_TRACKER_H
@@ -2,37 +2,366 @@
 
 using namespace std;
 
-PoseEstimation::PoseEstimation(float dsp_th) :
-  object_cloud_(new PointCloudN),
-  object_features_(new PointCloudFPFH)
-{
-  dsp_th_ = dsp_th;
-  object_model_path_ = "/home/dzp/model.pcd";
-  int ok = pcl::io::loadPCDFile<PointN>(object_model_path_, *object_cloud_);
-  if (ok < 0) {
-    has_object_model_ = false;
+/// Acceptance of a tracked pose
+float th_track_rms_ratio_ = 1.0; // Max RMS in ratio of dsp_th_
+float th_track_inlier_ratio_ = 0.25; // Min ratio of the model points having correspondences
+
+// Get the lowest z of the cloud, which is the bottom of a model in its resting pose
+static float getBottom(const PointCloudN::Ptr &cloud)
+{
+  float min_z = FLT_MAX;
+  for (const auto & pt : cloud->points) {
+    min_z = min(min_z, pt.z);
+  }
+  return min_z;
+}
+
+PoseEstimation::PoseEstimation(float dsp_th, const string &object_model_path) :
+  dsp_th_(dsp_th),
+  time_budget_(1.0),
+  confidence_(0.99f),
+  fitness_(FLT_MAX),
+  rms_(FLT_MAX),
+  cancelled_(false),
+  descriptor_(FPFH)
+{
+  if (!object_model_path.empty()) setObjectModel(object_model_path);
+}
+
+void PoseEstimation::setAlignmentLimits(double time_budget, float confidence)
+{
+  time_budget_ = time_budget;
+  confidence_ = confidence;
+}
+
+bool PoseEstimation::setObjectModel(const string &object_model_path)
+{
+  if (object_model_ && object_model_path == object_model_path_) return true;
+  object_model_path_ = object_model_path;
+  object_model_ = library_.get(object_model_path, dsp_th_);
+  return bool(object_model_);
+}
+
+void PoseEstimation::preloadObjectModels(const vector<string> &paths)
+{
+  library_.preload(paths, dsp_th_);
+}
+
+AlignmentProgress PoseEstimation::monitor()
+{
+  if (!progress_) return AlignmentProgress();
+  return [this](int iterations, float fitness, float inlier_ratio) {
+    return checkProgress(iterations, fitness, inlier_ratio);
+  };
+}
+
+bool PoseEstimation::checkProgress(int iterations, float fitness, float inlier_ratio)
+{
+  if (!progress_(iterations, fitness, inlier_ratio)) cancelled_ = true;
+  return !cancelled_;
+}
+
+void PoseEstimation::refine(const PointCloudN::Ptr &scene_cloud, Eigen::Matrix4f &trans)
+{
+  Eigen::Matrix4f refined = trans;
+  float inlier_ratio;
+  if (Utilities::refinePointToPlane(object_model_->cloud, scene_cloud, refined, 2.5f * dsp_th_, 30,
+                                    rms_, inlier_ratio)) {
+    trans = refined;
+    ROS_INFO("HoPE: Point-to-plane refinement RMS %f", rms_);
   } else {
-    Utilities::downSampling(object_cloud_, object_cloud_, dsp_th_, dsp_th_);
-    Utilities::estimateNormals(object_cloud_, object_cloud_, dsp_th_);
-    Utilities::estimateFPFH(object_cloud_, object_features_, dsp_th_);
-    has_object_model_ = true;
+    ROS_WARN("HoPE: Point-to-plane refinement failed, the coarse alignment is used.");
   }
 }
 
-bool PoseEstimation::estimate(PointCloudN::Ptr scene_cloud, Eigen::Matrix4f &trans, bool verbose) {
-  if (!has_object_model_) return false;
+bool PoseEstimation::track(const PointCloudN::Ptr &scene_cloud, Eigen::Matrix4f &trans)
+{
+  auto it = last_poses_.find(object_model_path_);
+  if (it == last_poses_.end()) return false;
+
+  Eigen::Matrix4f tracked = it->second;
+  float rms, inlier_ratio;
+  bool ok = Utilities::refinePointToPlane(object_model_->cloud, scene_cloud, tracked, 2.5f * dsp_th_, 30,
+                                          rms, inlier_ratio);
+  if (!ok || rms > th_track_rms_ratio_ * dsp_th_ || inlier_ratio < th_track_inlier_ratio_) {
+    ROS_INFO("HoPE: Tracking lost (RMS %f, inlier ratio %.3f), run global alignment.", rms, inlier_ratio);
+    return false;
+  }
+  ROS_INFO("HoPE: Tracked from the last pose, RMS %f, inlier ratio %.3f", rms, inlier_ratio);
+  rms_ = rms;
+  fitness_ = rms * rms;
+  trans = tracked;
+  it->second = tracked;
+  return true;
+}
+
+bool PoseEstimation::track(const PointCloudN::Ptr &scene_cloud, float plane_z, Eigen::Matrix4f &trans)
+{
+  auto it = last_poses_.find(object_model_path_);
+  if (it == last_poses_.end()) return false;
+
+  // The 6-DoF fallback may have found the object not upright, which is tracked in 6-DoF as well
+  if (it->second(2, 2) < 1.0f - 1e-3f) return track(scene_cloud, trans);
+
+  Eigen::Matrix4f tracked = it->second;
+  tracked(2, 3) = plane_z - getBottom(object_model_->cloud);
+  float fitness, inlier_ratio;
+  bool ok = Utilities::refine4DoF(object_model_->cloud, scene_cloud, tracked, 2.5f * dsp_th_, 10,
+                                  fitness, inlier_ratio);
+  // Point-to-point RMS, which bounds the point-to-plane one used in 6-DoF tracking
+  float rms = sqrt(fitness);
+  if (!ok || rms > th_track_rms_ratio_ * dsp_th_ || inlier_ratio < th_track_inlier_ratio_) {
+    ROS_INFO("HoPE: Tracking on the plane lost (RMS %f, inlier ratio %.3f), run global alignment.",
+             rms, inlier_ratio);
+    return false;
+  }
+  ROS_INFO("HoPE: Tracked on the plane from the last pose, RMS %f, inlier ratio %.3f", rms, inlier_ratio);
+  rms_ = rms;
+  fitness_ = fitness;
+  trans = tracked;
+  it->second = tracked;
+  return true;
+}
+
+void PoseEstimation::setLastPose(bool ok, const Eigen::Matrix4f &trans)
+{
+  if (ok) last_poses_[object_model_path_] = trans;
+  else last_poses_.erase(object_model_path_);
+}
 
+void PoseEstimation::prepareScene(PointCloudN::Ptr &scene_cloud)
+{
   Utilities::downSampling(scene_cloud, scene_cloud, dsp_th_, dsp_th_);
   Utilities::estimateNormals(scene_cloud, scene_cloud, dsp_th_);
+}
+
+bool PoseEstimation::alignWithGravityFeatures(const PointCloudN::Ptr &scene_cloud, float plane_z,
+                                              Eigen::Matrix4f &trans, float &inlier_ratio)
+{
+  const float radius = dsp_th_ * 5;
+  float min_z = getBottom(object_model_->cloud);
+
+  // The model features are computed once, with the bottom of the model as the plane
+  auto it = gravity_features_.find(object_model_path_);
+  if (it == gravity_features_.end()) {
+    cv::Mat features;
+    Utilities::estimateGravityFeatures(object_model_->cloud, min_z, radius, features);
+    it = gravity_features_.emplace(object_model_path_, features).first;
+  }
+
+  cv::Mat scene_features;
+  Utilities::estimateGravityFeatures(scene_cloud, plane_z, radius, scene_features);
+  vector<int> matches;
+  Utilities::matchGravityFeatures(it->second, scene_features, matches);
+
+  bool ok = Utilities::alignment4DoF(object_model_->cloud, scene_cloud, matches, plane_z - min_z, trans,
+                                     dsp_th_, confidence_, fitness_, inlier_ratio, monitor());
+  ROS_INFO("HoPE: 4-DoF alignment with gravity aligned features %s, fitness %f, inlier ratio %.3f",
+           ok ? "succeeded" : "failed", fitness_, inlier_ratio);
+  return ok;
+}
+
+bool PoseEstimation::alignOnPlane(const ObjectModel &model, const PointCloudN::Ptr &scene_cloud,
+                                  const PointCloudFPFH::Ptr &scene_features, float plane_z,
+                                  Eigen::Matrix4f &trans, float &inlier_ratio)
+{
+  // The bottom of the model is put onto the plane
+  float min_z = getBottom(model.cloud);
+  bool ok = Utilities::alignment4DoF(model.cloud, model.features, scene_cloud, scene_features,
+                                     plane_z - min_z, trans, dsp_th_, confidence_, fitness_, inlier_ratio,
+                                     monitor());
+  ROS_INFO("HoPE: 4-DoF alignment %s, fitness %f, inlier ratio %.3f",
+           ok ? "succeeded" : "failed", fitness_, inlier_ratio);
+  if (ok) return true;
+  if (cancelled_) return false;
+
+  // The object may not be in the resting pose of the model
+  PointCloudN::Ptr object_aligned(new PointCloudN);
+  int iterations;
+  ok = Utilities::alignmentWithFPFH(model.cloud, model.features,
+                                    scene_cloud, scene_features, trans, object_aligned, dsp_th_,
+                                    time_budget_, confidence_, fitness_, inlier_ratio, iterations, monitor());
+  if (ok) {
+    Eigen::Matrix4f refined = trans;
+    float ratio;
+    if (Utilities::refinePointToPlane(model.cloud, scene_cloud, refined, 2.5f * dsp_th_, 30, rms_, ratio)) {
+      trans = refined;
+      inlier_ratio = ratio;
+    }
+  }
+  return ok;
+}
+
+bool PoseEstimation::estimateOnPlane(PointCloudN::Ptr scene_cloud, float plane_z, Eigen::Matrix4f &trans)
+{
+  cancelled_ = false;
+  if (!object_model_) return false;
+
+  prepareScene(scene_cloud);
+  if (track(scene_cloud, plane_z, trans)) return true;
+
+  float inlier_ratio;
+  if (descriptor_ == GRAVITY && alignWithGravityFeatures(scene_cloud, plane_z, trans, inlier_ratio)) {
+    setLastPose(true, trans);
+    return true;
+  }
+  if (cancelled_) return false;
+
+  PointCloudFPFH::Ptr scene_features(new PointCloudFPFH);
+  Utilities::estimateFPFH(scene_cloud, scene_features, dsp_th_);
+
+  bool ok = alignOnPlane(*object_model_, scene_cloud, scene_features, plane_z, trans, inlier_ratio);
+  setLastPose(ok, trans);
+  return ok;
+}
+
+bool PoseEstimation::buildIndex(const vector<string> &paths)
+{
+  if (paths == index_paths_ && index_features_) return true;
+
+  index_paths_.clear();
+  index_models_.clear();
+  index_owners_.clear();
+  index_counts_.assign(paths.size(), 0);
+  index_features_.reset(new PointCloudFPFH);
+  for (size_t m = 0; m < paths.size(); ++m) {
+    ObjectModel::ConstPtr model = library_.get(paths[m], dsp_th_);
+    if (!model) {
+      index_features_.reset();
+      return false;
+    }
+    index_models_.push_back(model);
+    for (const auto & f : model->features->points) {
+      // Invalid features would break the index
+      if (!std::isfinite(f.histogram[0])) continue;
+      index_features_->points.push_back(f);
+      index_owners_.push_back(int(m));
+      index_counts_[m]++;
+    }
+  }
+  if (index_features_->points.empty()) {
+    index_features_.reset();
+    return false;
+  }
+  index_features_->width = index_features_->points.size();
+  index_features_->height = 1;
+  index_tree_.setInputCloud(index_features_);
+  index_paths_ = paths;
+  return true;
+}
+
+bool PoseEstimation::recognize(const vector<string> &paths, PointCloudN::Ptr scene_cloud, float plane_z,
+                               int &model_id, Eigen::Matrix4f &trans)
+{
+  // Number of models with most votes to be aligned
+  const size_t max_candidates = 3;
+
+  cancelled_ = false;
+  model_id = -1;
+  if (paths.empty() || !buildIndex(paths)) {
+    ROS_WARN("HoPE: Object models for recognition are not available.");
+    return false;
+  }
+
+  prepareScene(scene_cloud);
+  PointCloudFPFH::Ptr scene_features(new PointCloudFPFH);
+  Utilities::estimateFPFH(scene_cloud, scene_features, dsp_th_);
+
+  vector<int> votes(paths.size(), 0);
+  vector<int> nn(1);
+  vector<float> nn_dis(1);
+  for (const auto & f : scene_features->points) {
+    if (!std::isfinite(f.histogram[0])) continue;
+    if (index_tree_.nearestKSearch(f, 1, nn, nn_dis) < 1) continue;
+    votes[index_owners_[nn[0]]]++;
+  }
+
+  // Ratio of the features of each model matched by the scene
+  vector<float> scores(paths.size(), 0);
+  for (size_t m = 0; m < scores.size(); ++m) {
+    if (index_counts_[m] > 0) scores[m] = float(votes[m]) / index_counts_[m];
+  }
+
+  vector<int> order(paths.size());
+  for (size_t m = 0; m < order.size(); ++m) order[m] = int(m);
+  sort(order.begin(), order.end(), [&scores](int a, int b) { return scores[a] > scores[b]; });
+
+  float best_score = 0;
+  float best_fitness = FLT_MAX;
+  for (size_t k = 0; k < order.size() && k < max_candidates; ++k) {
+    int m = order[k];
+    if (votes[m] == 0) break;
+    Eigen::Matrix4f t;
+    float inlier_ratio;
+    if (!alignOnPlane(*index_models_[m], scene_cloud, scene_features, plane_z, t, inlier_ratio)) {
+      if (cancelled_) return false;
+      continue;
+    }
+    // The inlier ratio is on the model side and favours small models, the coverage
+    // is on the scene side and favours large ones, so both are required
+    float coverage = sceneCoverage(*index_models_[m], t, scene_cloud);
+    float score = sqrt(inlier_ratio * coverage);
+    ROS_INFO("HoPE: Model %s got %d votes (score %.3f), inlier ratio %.3f, scene coverage %.3f",
+             paths[m].c_str(), votes[m], scores[m], inlier_ratio, coverage);
+    if (score > best_score) {
+      best_score = score;
+      best_fitness = fitness_;
+      model_id = m;
+      trans = t;
+    }
+  }
+  // Report the fitness of the recognized model rather than the last one aligned
+  fitness_ = best_fitness;
+  return model_id >= 0;
+}
+
+float PoseEstimation::sceneCoverage(const ObjectModel &model, const Eigen::Matrix4f &trans,
+                                    const PointCloudN::Ptr &scene_cloud) const
+{
+  if (scene_cloud->points.empty() || model.cloud->points.empty()) return 0;
+  PointCloudN::Ptr model_aligned(new PointCloudN);
+  pcl::transformPointCloud(*model.cloud, *model_aligned, trans);
+
+  pcl::KdTreeFLANN<PointN> tree;
+  tree.setInputCloud(model_aligned);
+  const float th_sq = 2.5f * dsp_th_ * 2.5f * dsp_th_;
+  vector<int> nn(1);
+  vector<float> nn_dis(1);
+  size_t covered = 0;
+  for (const auto & pt : scene_cloud->points) {
+    if (tree.nearestKSearch(pt, 1, nn, nn_dis) > 0 && nn_dis[0] < th_sq) covered++;
+  }
+  return float(covered) / scene_cloud->points.size();
+}
+
+bool PoseEstimation::estimate(PointCloudN::Ptr scene_cloud, Eigen::Matrix4f &trans, bool verbose) {
+  cancelled_ = false;
+  if (!object_model_) return false;
+
+  prepareScene(scene_cloud);
+  if (track(scene_cloud, trans)) return true;
 
   PointCloudFPFH::Ptr scene_features(new PointCloudFPFH);
   Utilities::estimateFPFH(scene_cloud, scene_features, dsp_th_);
   //  pcl::io::savePCDFile("/home/dzp/scene.pcd", *scene_cloud);
-  //  pcl::io::savePCDFile("/home/dzp/obj.pcd", *object_cloud_);
+  //  pcl::io::savePCDFile("/home/dzp/obj.pcd", *object_cloud);
 
   PointCloudN::Ptr object_aligned(new PointCloudN);
-  bool ok = Utilities::alignmentWithFPFH(object_cloud_, object_features_,
-                                         scene_cloud, scene_features, trans, object_aligned, dsp_th_);
+  // The model is shared with the library, the alignment only reads it
+  PointCloudN::Ptr object_cloud = object_model_->cloud;
+  PointCloudFPFH::Ptr object_features = object_model_->features;
+  float inlier_ratio;
+  int iterations;
+  bool ok = Utilities::alignmentWithFPFH(object_cloud, object_features,
+                                         scene_cloud, scene_features, trans, object_aligned, dsp_th_,
+                                         time_budget_, confidence_, fitness_, inlier_ratio, iterations, monitor());
+  ROS_INFO("HoPE: Alignment %s after %d iterations, fitness %f, inlier ratio %.3f",
+           ok ? "succeeded" : "failed", iterations, fitness_, inlier_ratio);
+  if (ok) {
+    refine(scene_cloud, trans);
+    pcl::transformPointCloud(*object_cloud, *object_aligned, trans);
+  }
+  setLastPose(ok, trans);
 
   printf("    | %6.3f %6.3f %6.3f | \n", trans(0,0), trans(0,1), trans(0,2));
   printf("R = | %6.3f %6.3f %6.3f | \n", trans(1,0), trans(1,1), trans(1,2));
@@ -2,23 +2,163 @@
 #define SRC_POSE_ESTIMATION_H
 
 #include "utilities.h"
+#include "model_library.h"
+
+#include <map>
 
 
 class PoseEstimation
 {
 public:
-  PoseEstimation(float dsp_th = 0.005f);
+  // Features used by the alignment in estimateOnPlane
+  enum descriptor_type{FPFH = 0, GRAVITY = 1};
+
+  /**
+   * @param dsp_th Down sampling size of the object model and the scene
+   * @param object_model_path Path to the .pcd file of the object model, could be empty
+   * and set later with setObjectModel
+   */
+  PoseEstimation(float dsp_th = 0.005f, const std::string &object_model_path = "");
+
+  /// Select the object model to estimate, the model is preprocessed on first use
+  bool setObjectModel(const std::string &object_model_path);
+
+  /// Preprocess the object models in advance
+  void preloadObjectModels(const std::vector<std::string> &paths);
 
+  /**
+   * Estimate the pose of the object model in the scene. If the model has been found
+   * before, the last pose is refined first and the global alignment only runs if
+   * the refined pose does not fit the scene.
+   */
   bool estimate(PointCloudN::Ptr scene, Eigen::Matrix4f &trans, bool verbose = false);
 
+  /**
+   * Estimate the pose of an object standing on a horizontal plane. The object model
+   * should be in its resting pose with z pointing up, so that only yaw and xy are unknown.
+   * Fall back to the 6-DoF estimation if the constrained one fails.
+   * @param scene Scene cloud in the base frame
+   * @param plane_z Height of the plane the object stands on
+   */
+  bool estimateOnPlane(PointCloudN::Ptr scene, float plane_z, Eigen::Matrix4f &trans);
+
+  /**
+   * Recognize which of the object models is in the scene and estimate its pose. The scene
+   * features are computed once and matched against all models with a shared feature index,
+   * each scene feature votes for the model owning its nearest model feature. The votes are
+   * divided by the number of features of each model, so that large models are not favoured.
+   * The models with the highest scores are then aligned. The one with the highest geometric
+   * mean of its inlier ratio and its coverage of the scene wins, so that neither a small
+   * model matching a part of the object nor a large model enclosing it is favoured.
+   * @param paths Paths to the .pcd files of the candidate models
+   * @param scene Scene cloud in the base frame, containing one object
+   * @param plane_z Height of the plane the object stands on
+   * @param model_id Output index of the recognized model in paths
+   * @param trans Output pose of the recognized model
+   */
+  bool recognize(const std::vector<std::string> &paths, PointCloudN::Ptr scene, float plane_z,
+                 int &model_id, Eigen::Matrix4f &trans);
+
+  /**
+   * Set the limits of the alignment in estimate.
+   * @param time_budget Max wall time in seconds for each alignment, 0 for no limit
+   * @param confidence The alignment stops once the best hypothesis reaches this confidence
+   */
+  void setAlignmentLimits(double time_budget, float confidence);
+
+  /**
+   * Select the features for estimateOnPlane. GRAVITY features are much cheaper than FPFH
+   * but rely on the object standing upright, FPFH is used if the alignment with them fails.
+   */
+  inline void setDescriptor(descriptor_type descriptor) { descriptor_ = descriptor; }
+
+  /// Fitness score (mean squared inlier distance) of the last alignment or tracked pose
+  inline float getFitness() const { return fitness_; }
+
+  /// RMS of the point-to-plane distances after the last refinement
+  inline float getRMS() const { return rms_; }
+
+  /**
+   * Set the callback for the progress of the alignments, an empty one to remove it. Once it
+   * returns false, the running estimation returns false at once without any fallback.
+   */
+  inline void setProgressCallback(const AlignmentProgress &progress) { progress_ = progress; }
+
+  /// Whether the last estimation is cancelled by the progress callback
+  inline bool isCancelled() const { return cancelled_; }
+
+  /// Forget the last poses of all models
+  inline void resetTracking() { last_poses_.clear(); }
+
 private:
   float dsp_th_;
 
-  bool has_object_model_;
+  double time_budget_;
+  float confidence_;
+  float fitness_;
+  float rms_;
+  AlignmentProgress progress_;
+  bool cancelled_;
+  descriptor_type descriptor_;
+
   std::string object_model_path_;
+  ObjectModel::ConstPtr object_model_;
+
+  ModelLibrary library_;
+
+  // Last accepted pose of each model, keyed by the model path
+  std::map<std::string, Eigen::Matrix4f, std::less<std::string>,
+      Eigen::aligned_allocator<std::pair<const std::string, Eigen::Matrix4f> > > last_poses_;
+
+  // Gravity aligned features of each model, keyed by the model path
+  std::map<std::string, cv::Mat> gravity_features_;
+
+  // Feature index shared by the models in recognize, rebuilt if the models change
+  std::vector<std::string> index_paths_;
+  std::vector<ObjectModel::ConstPtr> index_models_;
+  PointCloudFPFH::Ptr index_features_;
+  // Index of the model owning each feature in index_features_
+  std::vector<int> index_owners_;
+  // Number of features of each model in index_features_
+  std::vector<int> index_counts_;
+  pcl::KdTreeFLANN<FeatureFPFH> index_tree_;
+
+  /// Progress callback passed to the alignments, which records the cancellation
+  AlignmentProgress monitor();
+  bool checkProgress(int iterations, float fitness, float inlier_ratio);
+
+  /// Down sample the scene and compute its normals
+  void prepareScene(PointCloudN::Ptr &scene_cloud);
+
+  /// Build the shared feature index of the models, return false if any model is not available
+  bool buildIndex(const std::vector<std::string> &paths);
+
+  /// Ratio of the scene points within the inlier distance of the model transformed by trans
+  float sceneCoverage(const ObjectModel &model, const Eigen::Matrix4f &trans,
+                      const PointCloudN::Ptr &scene_cloud) const;
+
+  /// Align the model standing on the plane with 4-DoF, and 6-DoF with refinement as the fallback
+  bool alignOnPlane(const ObjectModel &model, const PointCloudN::Ptr &scene_cloud,
+                    const PointCloudFPFH::Ptr &scene_features, float plane_z,
+                    Eigen::Matrix4f &trans, float &inlier_ratio);
+
+  /// Align the model standing on the plane with the gravity aligned features
+  bool alignWithGravityFeatures(const PointCloudN::Ptr &scene_cloud, float plane_z,
+                                Eigen::Matrix4f &trans, float &inlier_ratio);
+
+  /// Refine the coarse alignment of the object model with point-to-plane ICP
+  void refine(const PointCloudN::Ptr &scene_cloud, Eigen::Matrix4f &trans);
+
+  /// Refine the last pose of the object model, return false if the result does not fit the scene
+  bool track(const PointCloudN::Ptr &scene_cloud, Eigen::Matrix4f &trans);
+
+  /**
+   * Same as above for an object standing on the plane. If the last pose keeps the model
+   * upright, only yaw and xy are refined and the bottom of the model stays on the plane.
+   */
+  bool track(const PointCloudN::Ptr &scene_cloud, float plane_z, Eigen::Matrix4f &trans);
 
-  PointCloudN::Ptr object_cloud_;
-  PointCloudFPFH::Ptr object_features_;
+  void setLastPose(bool ok, const Eigen::Matrix4f &trans);
 };
 
 
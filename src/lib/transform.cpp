@@ -13,6 +13,12 @@ Transform::Transform() :
 }
 
 bool Transform::getTransform(string base_frame, string header_frame)
+{
+  return getTransform(base_frame, header_frame, tf_handle_);
+}
+
+bool Transform::getTransform(string base_frame, string header_frame,
+                             geometry_msgs::TransformStamped &tf_handle)
 {
   try {
     // While we aren't supposed to be shutting down
@@ -20,7 +26,7 @@ bool Transform::getTransform(string base_frame, string header_frame)
       // Check if the transform from map to quad can be made right now
       if (tf_buffer_.canTransform(base_frame, header_frame, ros::Time(0))) {
         // Get the transform
-        tf_handle_ = tf_buffer_.lookupTransform(base_frame, header_frame, ros::Time(0));
+        tf_handle = tf_buffer_.lookupTransform(base_frame, header_frame, ros::Time(0));
         return true;
       } else {
         ROS_WARN("HoPE: Transform from '%s' to '%s' does not exist.", base_frame.c_str(), header_frame.c_str());
@@ -36,6 +42,7 @@ bool Transform::getTransform(string base_frame, string header_frame)
               ex.what());
     return false;
   }
+  return false;
 }
 
 void Transform::doTransform(PointCloud::Ptr cloud_in,
@@ -72,8 +79,14 @@ void Transform::doTransform(PointCloud::Ptr cloud_in,
 void Transform::doTransform(PointCloudMono::Ptr cloud_in, 
                             PointCloudMono::Ptr &cloud_out)
 {
-  geometry_msgs::Vector3 trans = tf_handle_.transform.translation;
-  geometry_msgs::Quaternion rotate = tf_handle_.transform.rotation;
+  doTransform(cloud_in, cloud_out, tf_handle_);
+}
+
+void Transform::doTransform(PointCloudMono::Ptr cloud_in, PointCloudMono::Ptr &cloud_out,
+                            const geometry_msgs::TransformStamped &tf_handle)
+{
+  geometry_msgs::Vector3 trans = tf_handle.transform.translation;
+  geometry_msgs::Quaternion rotate = tf_handle.transform.rotation;
   
   Eigen::Transform<float,3,Eigen::Affine> t = Eigen::Translation3f(trans.x,
                                                                    trans.y,
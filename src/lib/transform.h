@@ -32,9 +32,16 @@ public:
 
   bool getTransform(string base_frame, string header_frame);
 
+  /// Look up the transform into tf_handle instead of the member, safe to call concurrently
+  bool getTransform(string base_frame, string header_frame, geometry_msgs::TransformStamped &tf_handle);
+
   void doTransform(PointCloud::Ptr cloud_in, PointCloud::Ptr &cloud_out);
   
   void doTransform(PointCloudMono::Ptr cloud_in, PointCloudMono::Ptr &cloud_out);
+
+  /// Transform the cloud with given tf_handle
+  static void doTransform(PointCloudMono::Ptr cloud_in, PointCloudMono::Ptr &cloud_out,
+                          const geometry_msgs::TransformStamped &tf_handle);
   
   void doTransform(PointCloud::Ptr cloud_in, PointCloud::Ptr &cloud_out,
                    float roll, float pitch, float yaw);
@@ -1,8 +1,19 @@
 #include "utilities.h"
+#include "contour_mask.h"
+
+#include <unordered_map>
+#include <chrono>
+#include <random>
 
 using namespace std;
 using namespace cv;
 
+// Pack the coordinates of a 3D cell into a key, 21 bits for each axis
+static inline int64_t getCellKey(int x, int y, int z)
+{
+  return (int64_t(x & 0x1fffff) << 42) | (int64_t(y & 0x1fffff) << 21) | int64_t(z & 0x1fffff);
+}
+
 Vec3b pascal_map[] = {
     Vec3b(0,0,0),
     Vec3b(128,0,0),
@@ -530,44 +541,150 @@ void Utilities::convertToColorCloud(const PointCloudMono::Ptr& cloud_in,
   }
 }
 
-template <typename T, typename U>
-void Utilities::sliceCloudWithPlane(pcl::ModelCoefficients::Ptr coeff_in, float th_distance,
-                                    T cloud_in, U &cloud_out)
+void Utilities::sliceCloudByZ(const PointCloudMono::Ptr& cloud_in, float z, float th_distance,
+                              PointCloudMono::Ptr &cloud_out, size_t min_num)
 {
-  Eigen::Vector4f coeff(coeff_in->values[0], coeff_in->values[1],
-                        coeff_in->values[2], coeff_in->values[3]);
+  // Band k holds the points whose distance to z is within [th + (k-1) * step, th + k * step),
+  // band 0 holds those closer than th
+  const int band_num = 5;
+  const float step = 0.001;
+  size_t counts[band_num] = {0};
+  for (const auto & pt : cloud_in->points) {
+    float dis = fabs(pt.z - z);
+    if (!(dis < th_distance + (band_num - 1) * step)) continue;
+    int k = dis < th_distance ? 0 : int((dis - th_distance) / step) + 1;
+    counts[k < band_num ? k : band_num - 1]++;
+  }
+
+  // The tightest band with enough points, otherwise the widest one
+  int band = 0;
+  size_t acc = counts[0];
+  while (acc < min_num && band < band_num - 1) {
+    band++;
+    acc += counts[band];
+  }
+  float th = th_distance + band * step;
 
-  PointCloudMono::Ptr cloud_in_mono(new PointCloudMono);
-  std::vector<int> inliers;
-  convertCloudType(cloud_in, cloud_in_mono);
-  pcl::SampleConsensusModelPlane<pcl::PointXYZ> scmp(cloud_in_mono);
-  int slice_count = 5;
-  while (slice_count) {
-    inliers.clear();
-    scmp.selectWithinDistance(coeff, th_distance, inliers);
-    if (inliers.size() >= 4) break;
-    else th_distance += 0.001;
-    slice_count--;
+  // Project the points in the band to the plane z
+  cloud_out->clear();
+  cloud_out->points.reserve(acc);
+  for (const auto & pt : cloud_in->points) {
+    if (fabs(pt.z - z) < th) cloud_out->points.emplace_back(pt.x, pt.y, z);
   }
-  assert(!inliers.empty());
-  scmp.projectPoints(inliers, coeff, *cloud_out, false);
+  cloud_out->width = cloud_out->points.size();
+  cloud_out->height = 1;
+  cloud_out->is_dense = true;
 }
 
 void Utilities::extractClusters(PointCloudMono::Ptr cloud_in,
                                 vector<pcl::PointIndices> &cluster_indices,
                                 float th_cluster, int minsize, int maxsize)
 {
-  pcl::search::KdTree<pcl::PointXYZ>::Ptr tree (new pcl::search::KdTree<pcl::PointXYZ>);
-  pcl::EuclideanClusterExtraction<pcl::PointXYZ> ec;
-  ec.setClusterTolerance(th_cluster);
+  cluster_indices.clear();
+  if (cloud_in->points.empty()) return;
+
+  // With this cell size any two points in one cell are within th_cluster, and
+  // points within th_cluster are at most 2 cells apart along each axis
+  const float cell_size = th_cluster / sqrt(3.0f);
+  const float th_sq = th_cluster * th_cluster;
+
+  // Sort the points by their cells so that each cell is a contiguous run
+  vector<pair<int64_t, int> > keyed;
+  keyed.reserve(cloud_in->points.size());
+  for (size_t i = 0; i < cloud_in->points.size(); ++i) {
+    const pcl::PointXYZ &pt = cloud_in->points[i];
+    if (!isfinite(pt.x) || !isfinite(pt.y) || !isfinite(pt.z)) continue;
+    keyed.emplace_back(getCellKey(int(floor(pt.x / cell_size)), int(floor(pt.y / cell_size)),
+                                  int(floor(pt.z / cell_size))), int(i));
+  }
+  sort(keyed.begin(), keyed.end());
+
+  vector<size_t> cell_begin;
+  unordered_map<int64_t, int> cell_ids;
+  cell_ids.reserve(keyed.size());
+  for (size_t k = 0; k < keyed.size(); ++k) {
+    if (k == 0 || keyed[k].first != keyed[k - 1].first) {
+      cell_ids.emplace(keyed[k].first, int(cell_begin.size()));
+      cell_begin.push_back(k);
+    }
+  }
+  cell_begin.push_back(keyed.size());
+  size_t cell_num = cell_begin.size() - 1;
+
+  // Union find over cells
+  vector<int> parent(cell_num);
+  for (size_t c = 0; c < cell_num; ++c) parent[c] = int(c);
+  auto find_root = [&parent](int c) {
+    while (parent[c] != c) {
+      parent[c] = parent[parent[c]];
+      c = parent[c];
+    }
+    return c;
+  };
+
+  for (size_t a = 0; a < cell_num; ++a) {
+    const pcl::PointXYZ &ref = cloud_in->points[keyed[cell_begin[a]].second];
+    int cx = int(floor(ref.x / cell_size));
+    int cy = int(floor(ref.y / cell_size));
+    int cz = int(floor(ref.z / cell_size));
+    // Only visit half of the neighbours since the connection is symmetric
+    for (int dx = 0; dx <= 2; ++dx) {
+      for (int dy = -2; dy <= 2; ++dy) {
+        for (int dz = -2; dz <= 2; ++dz) {
+          if (dx == 0 && (dy < 0 || (dy == 0 && dz <= 0))) continue;
+          auto it = cell_ids.find(getCellKey(cx + dx, cy + dy, cz + dz));
+          if (it == cell_ids.end()) continue;
+          int b = it->second;
+          int ra = find_root(int(a));
+          int rb = find_root(b);
+          if (ra == rb) continue;
+
+          // Two cells are connected if any pair of their points is close enough
+          bool connected = false;
+          for (size_t i = cell_begin[a]; i < cell_begin[a + 1] && !connected; ++i) {
+            const pcl::PointXYZ &p = cloud_in->points[keyed[i].second];
+            for (size_t j = cell_begin[b]; j < cell_begin[b + 1]; ++j) {
+              const pcl::PointXYZ &q = cloud_in->points[keyed[j].second];
+              float d = (p.x - q.x) * (p.x - q.x) + (p.y - q.y) * (p.y - q.y) + (p.z - q.z) * (p.z - q.z);
+              if (d <= th_sq) {
+                connected = true;
+                break;
+              }
+            }
+          }
+          if (connected) parent[rb] = ra;
+        }
+      }
+    }
+  }
+
+  // Gather the points of each component
+  vector<int> cluster_of_root(cell_num, -1);
+  vector<pcl::PointIndices> clusters;
+  for (size_t c = 0; c < cell_num; ++c) {
+    int root = find_root(int(c));
+    if (cluster_of_root[root] < 0) {
+      cluster_of_root[root] = int(clusters.size());
+      clusters.push_back(pcl::PointIndices());
+    }
+    vector<int> &indices = clusters[cluster_of_root[root]].indices;
+    for (size_t k = cell_begin[c]; k < cell_begin[c + 1]; ++k) {
+      indices.push_back(keyed[k].second);
+    }
+  }
 
-  // 3 is used for minsize and 640*480 is used for maxsize
-  // cause the filter of cluster should be performed somewhere else
-  ec.setMinClusterSize(minsize);
-  ec.setMaxClusterSize(maxsize);
-  ec.setSearchMethod(tree);
-  ec.setInputCloud(cloud_in);
-  ec.extract(cluster_indices);
+  // Keep the clusters within the size range, the largest first like EuclideanClusterExtraction
+  // does, ties are broken by the first point so that the order is deterministic
+  for (auto & cluster : clusters) {
+    if (int(cluster.indices.size()) < minsize || int(cluster.indices.size()) > maxsize) continue;
+    sort(cluster.indices.begin(), cluster.indices.end());
+    cluster_indices.push_back(std::move(cluster));
+  }
+  sort(cluster_indices.begin(), cluster_indices.end(),
+       [](const pcl::PointIndices &a, const pcl::PointIndices &b) {
+    if (a.indices.size() != b.indices.size()) return a.indices.size() > b.indices.size();
+    return a.indices[0] < b.indices[0];
+  });
 }
 
 void Utilities::projectCloudTo2D(const pcl::ModelCoefficients::Ptr& coeff_in,
@@ -917,89 +1034,6 @@ bool Utilities::isIntersect(pcl::PointXY p1, pcl::PointXY p2,
   return !(miu > 1 || miu < 0);
 }
 
-void Utilities::matFill(vector<vector<float> > features, Mat &out)
-{
-  // Each row corresponds to a plane while each column to a feature
-  for (size_t r = 0; r < features.size(); ++r) {
-    for (size_t c = 0; c < features[r].size(); ++c) {
-      out.at<float>(r, c) = features[r][c];
-    }
-  }
-}
-
-void Utilities::matNormalize(Mat query_in, Mat train_in,
-                             Mat &query_out, Mat &train_out)
-{
-  query_out = Mat(query_in.rows, query_in.cols, query_in.type());
-  train_out = Mat(train_in.rows, train_in.cols, train_in.type());
-
-  for (size_t c = 0; c < query_in.cols; ++c) {
-
-    float acc = 0;
-    for (size_t r = 0; r < query_in.rows; ++r) {
-      float val = query_in.at<float>(r, c);
-      acc += val;
-    }
-    for (size_t r = 0; r < train_in.rows; ++r) {
-      float val = train_in.at<float>(r, c);
-      acc += val;
-    }
-    float r_mean = acc / float(query_in.rows + train_in.rows);
-
-    acc = 0;
-    for (size_t r = 0; r < query_in.rows; ++r) {
-      float val = query_in.at<float>(r, c);
-      acc += pow(val - r_mean, 2);
-    }
-    for (size_t r = 0; r < train_in.rows; ++r) {
-      float val = train_in.at<float>(r, c);
-      acc += pow(val - r_mean, 2);
-    }
-
-    float sd = sqrt(acc / float(query_in.rows + train_in.rows));
-
-    for (size_t r = 0; r < query_in.rows; ++r) {
-      float val = query_in.at<float>(r, c);
-      val = (val - r_mean) / sd;
-      query_out.at<float>(r, c) = val;
-    }
-    for (size_t r = 0; r < train_in.rows; ++r) {
-      float val = train_in.at<float>(r, c);
-      val = (val - r_mean) / sd;
-      train_out.at<float>(r, c) = val;
-    }
-  }
-}
-
-// Note that the limit restricted the total number of planes being found
-void Utilities::searchAvailableID(vector<int> id_used,
-                                  vector<int> &id_ava,
-                                  size_t limit=1024)
-{
-  //  sort(id_used.begin(),id_used.end());
-  //  int min_id = id_used[0];
-  //  int max_id = id_used[id_used.size()-1];
-  //  for (size_t i = max_id + 1; i < max_id + limit; ++i) {
-  //    int p = i;
-  //    if (p >= limit) {
-  //      p -= limit;
-  //    }
-  //    if (p > max_id || p < min_id)
-  //      id_ava.push_back(p);
-  //  }
-  for (size_t i = 0; i < limit; ++i) {
-    bool i_used = false;
-    for (int n : id_used) {
-      if (i == n) {
-        i_used = true;
-        break;
-      }
-    }
-    if (!i_used)
-      id_ava.push_back(i);
-  }
-}
-
 void Utilities::getClosestPoint(pcl::PointXY p1, pcl::PointXY p2,
                                 pcl::PointXY p, pcl::PointXY &pc)
 {
@@ -1047,177 +1081,6 @@ bool Utilities::isInVector(int id, vector<int> &vec)
   return false;
 }
 
-bool Utilities::isInVector(int id, vector<vector<int> > vec, int &pos)
-{
-  for (size_t e = 0; e < vec.size(); ++e) {
-    for (size_t i = 0; i < vec[i].size(); ++i) {
-      if (id == vec[e][i]) {
-        pos = e;
-        return true;
-      }
-    }
-    return false;
-  }
-}
-
-void Utilities::matchID(vector<vector<float> > global, vector<vector<float> > local,
-                        vector<int> in, vector<int> &out, int feature_dim)
-{
-  // Get new id that can be used
-  vector<int> id_ava;
-  searchAvailableID(in, id_ava);
-
-  // Allocate space for output
-  out.resize(local.size());
-
-  // Rearrange the data into Mat
-  Mat m1(Size(feature_dim, local.size()), CV_32FC1); // Size w*h
-  Mat m2(Size(feature_dim, global.size()), CV_32FC1);
-
-  matFill(local, m1);
-  matFill(global, m2);
-
-  FlannBasedMatcher matcher;
-  vector<DMatch> matches;
-
-  Mat query, train;
-  matNormalize(m1, m2, query, train);
-
-  matcher.match(query, train, matches);
-
-  //  pair<int, int> best;
-  //  float mind = 100;
-  //  for (size_t j = 0; j < local.size(); ++j) {
-  //    if (matches[j].distance < mind) {
-  //      best.first = j;
-  //      best.second = matches[j].trainIdx;
-  //      mind = matches[j].distance;
-  //    }
-  //  }
-  //  for (size_t j = 0; j < local.size(); ++j) {
-  //    if (j == best.first) {
-  //      out[j] = in[best.second];
-  //    }
-  //    else {
-  //      out[j] = -1;
-  //    }
-  //  }
-
-  // One query feature can only have one corresponding train feature and vise versa
-  vector<float> g_dist_temp(global.size(), 10000);
-  vector<int> match_for_g(global.size(), -1);
-  for (size_t i = 0; i < global.size(); ++i) {
-    for (auto & match : matches) {
-      if (i == match.trainIdx) {
-        if (match.distance < g_dist_temp[i]) {
-          g_dist_temp[i] = match.distance;
-          match_for_g[i] = match.queryIdx;
-        }
-      }
-    }
-  }
-
-  // One global feature can have multiple query matchers if they together yield smaller distance
-  //  vector<float> g_dist_temp(global.size(), 10000);
-  //  vector<vector<int> > match_for_g(global.size()); // store query features' ids for each train feature
-  //  for (size_t g_idx = 0; g_idx < global.size(); ++g_idx) {
-  //    // local size is equal to matches size
-  //    for (size_t l_idx = 0; l_idx < matches.size(); ++l_idx) {
-  //      if (g_idx == matches[l_idx].trainIdx) {
-  //        if (matches[l_idx].distance < g_dist_temp[g_idx]) {
-  //          if (match_for_g[g_idx].size() == 0) {
-  //            match_for_g[g_idx].push_back(matches[l_idx].queryIdx);
-  //          }
-  //          else {
-  //            //if (mergeOrReplace(g_idx, match_for_g[g_idx], matches[l_idx].queryIdx, global, local)) {
-  //              // merge
-  //              match_for_g[g_idx].push_back(matches[l_idx].queryIdx);
-  //            //}
-  //            //else {
-  //            //  // replace
-  //            //  match_for_g[g_idx].erase(match_for_g[g_idx].begin());
-  //            //  match_for_g[g_idx].push_back(matches[l_idx].queryIdx);
-  //            //}
-  //          }
-  //        }
-  //      }
-  //    }
-  //  }
-
-  for (size_t j = 0; j < local.size(); ++j) {
-    int pos = -1;
-    if (isInVector(j, match_for_g, pos)) {
-      out[j] = in[pos];
-      //cout << "current: " << j << " matches: " << pos << " score " << matches[j].distance << endl;
-    }
-    else {
-      out[j] = id_ava[0];
-      id_ava.erase(id_ava.begin());
-      //cout << "assign: " << j << " to: " << id_ava[0] << " score " << matches[j].distance << endl;
-    }
-  }
-}
-
-bool Utilities::mergeOrReplace(size_t g_id, vector<int> l_ids, size_t q_id,
-                               vector<vector<float> > global, vector<vector<float> > local)
-{
-  //  vector<float> g_feat = global(g_id);
-
-  //  // Prepare feature vector for previous optimal
-  //  vector<float> p_feat(5, 9999);
-  //  for (size_t i = 0; i < l_ids.size(); ++i) {
-  //    vector<float> temp = local[l_ids[i]];
-  //    for (size_t j = 0; j < temp.size(); ++j) {
-  //      if (j == 0)
-  //        p_feat[j] += temp[j];
-  //      // xmin ymin xmax ymax
-  //      else if (j == 1 || j == 2) {
-  //        if (p_feat[j] == 9999) {
-  //          p_feat[j] = temp[j];
-  //        }
-  //        if (temp[j] < p_feat[j] ) {
-  //          p_feat[j] = temp[j];
-  //        }
-  //      }
-  //      else {
-  //        if (p_feat[j] == 9999) {
-  //          p_feat[j] = temp[j];
-  //        }
-  //        if (temp[j] > p_feat[j] ) {
-  //          p_feat[j] = temp[j];
-  //        }
-  //      }
-  //    }
-  //  }
-  //  p_feat[0] /= l_ids.size();
-
-  //  // Current feature vector
-  //  vector<float> q_feat = local[q_id];
-
-  //  // Compare the distance
-  //  float disPrev = computeFeatureDis(g_feat, p_feat);
-  //  float disCurr = computeFeatureDis(g_feat, q_feat);
-  //  float disComb = computeFeatureDis(g_feat, q_combine);
-
-  //  if (disPrev < disCurr) {
-  //    if (disPrev < disComb) {
-  //      return -1; // ignore
-  //    }
-  //    else {
-  //      if (disComb < disCurr) {
-  //        return 1; // merge
-  //      }
-
-  //    }
-  //  }
-  //  else {
-  //    if (disCurr < disComb)
-  //  }
-
-  //  return true; // merge
-  return false; // replace
-}
-
 float Utilities::shortRainbowColorMap(const double &value,
                                       const double &min,
                                       const double &max) {
@@ -1352,16 +1215,19 @@ bool Utilities::isInContour(const PointCloudMono::Ptr& contour, pcl::PointXY p)
     Eigen::Vector3f pvi(v_i.x - p.x, v_i.y - p.y, 0);  // add z dim since cross only apply to Vector3
     Eigen::Vector3f pvj(v_j.x - p.x, v_j.y - p.y, 0);
 
-    // This function calculate the included angle between pvi and pvj
-    float angle = atan2(pvi.cross(pvj).norm(), pvi.dot(pvj));
-    angle_sum += fabs(angle);
+    // This function calculate the signed included angle between pvi and pvj
+    float cross = pvi.cross(pvj)(2);
+    float dot = pvi.dot(pvj);
+    // p is on the edge (v_i, v_j)
+    if (cross == 0 && dot <= 0) return true;
+    angle_sum += atan2(cross, dot);
   }
-  return fabs(angle_sum - 2 * M_PI) < 0.01;
+  return fabs(fabs(angle_sum) - 2 * M_PI) < 0.01;
 }
 
 //template<typename T>
 bool Utilities::getClustersUponPlane(const PointCloudMono::Ptr& src_cloud, const PointCloudMono::Ptr& contour,
-                                     vector<PointCloudMono::Ptr> &clusters) {
+                                     vector<PointCloudMono::Ptr> &clusters, float resolution) {
   // Get cloud upon the given contour from src_cloud
   float z_mean, z_max, z_min, z_mid;
   getCloudZInfo<PointCloudMono::Ptr>(contour, z_mean, z_max, z_min, z_mid);
@@ -1369,27 +1235,10 @@ bool Utilities::getClustersUponPlane(const PointCloudMono::Ptr& src_cloud, const
   PointCloudMono::Ptr temp(new PointCloudMono);
   pcl::PointIndices::Ptr inliers(new pcl::PointIndices);
 
-  vector<pcl::PointXY> rect;
-  pcl::PointXY center{};
-  float width, height;
-  getStraightRect2D(contour, rect, center, width, height);
-
-  for (size_t i = 0; i < src_cloud->points.size(); i++) {
-    if (src_cloud->points[i].z < z_max + 0.01)
-      continue;
-    if (fabs(src_cloud->points[i].x - center.x) > width * 0.5 ||
-        fabs(src_cloud->points[i].y - center.y) > height * 0.5 ) {
-      continue;
-    }
-
-    pcl::PointXY p{};
-    p.x = src_cloud->points[i].x;
-    p.y = src_cloud->points[i].y;
-
-    if (isInContour(contour, p)) {
-      inliers->indices.push_back(i);
-    }
-  }
+  // Rasterize the contour once, so that most points are classified by a lookup
+  ContourMask mask;
+  mask.build(contour, resolution);
+  mask.getInliers(src_cloud, z_max + 0.01f, inliers->indices);
   getCloudByInliers(src_cloud, temp, inliers, false, false);
 
   // Cluster the extracted cloud into different objects
@@ -1407,6 +1256,72 @@ bool Utilities::getClustersUponPlane(const PointCloudMono::Ptr& src_cloud, const
   return !clusters.empty();
 }
 
+bool Utilities::getClustersUponPlaneOrganized(const PointCloudMono::Ptr& src_cloud, const PointCloudMono::Ptr& contour,
+                                              vector<PointCloudMono::Ptr> &clusters, float resolution,
+                                              float th_cluster) {
+  float z_mean, z_max, z_min, z_mid;
+  getCloudZInfo<PointCloudMono::Ptr>(contour, z_mean, z_max, z_min, z_mid);
+
+  int width = int(src_cloud->width);
+  int height = int(src_cloud->height);
+
+  // Mask the pixels above the plane and inside the contour, NaN pixels never pass
+  vector<int> inliers;
+  ContourMask mask;
+  mask.build(contour, resolution);
+  mask.getInliers(src_cloud, z_max + 0.01f, inliers);
+
+  // Label 0 for masked out pixels, -1 for masked in but not visited
+  vector<int> labels(src_cloud->points.size(), 0);
+  for (int i : inliers) labels[i] = -1;
+
+  const float th_sq = th_cluster * th_cluster;
+  const int offsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  vector<int> queue;
+  queue.reserve(inliers.size());
+  int label = 0;
+  for (int seed : inliers) {
+    if (labels[seed] != -1) continue;
+    label++;
+
+    // Breadth first search in image space
+    queue.clear();
+    queue.push_back(seed);
+    labels[seed] = label;
+    for (size_t q = 0; q < queue.size(); ++q) {
+      int u = queue[q] % width;
+      int v = queue[q] / width;
+      const pcl::PointXYZ &p = src_cloud->points[queue[q]];
+      for (auto offset : offsets) {
+        int nu = u + offset[0];
+        int nv = v + offset[1];
+        if (nu < 0 || nv < 0 || nu >= width || nv >= height) continue;
+        int n = nv * width + nu;
+        if (labels[n] != -1) continue;
+        const pcl::PointXYZ &r = src_cloud->points[n];
+        float d = (p.x - r.x) * (p.x - r.x) + (p.y - r.y) * (p.y - r.y) + (p.z - r.z) * (p.z - r.z);
+        if (d > th_sq) continue;
+        labels[n] = label;
+        queue.push_back(n);
+      }
+    }
+
+    // Same size limits as the clustering in 3D space
+    if (queue.size() < 10 || queue.size() > 240000) continue;
+    sort(queue.begin(), queue.end());
+    PointCloudMono::Ptr cluster(new PointCloudMono);
+    cluster->points.reserve(queue.size());
+    for (int i : queue) {
+      cluster->points.push_back(src_cloud->points[i]);
+    }
+    cluster->width = cluster->points.size();
+    cluster->height = 1;
+    cluster->is_dense = true;
+    clusters.push_back(cluster);
+  }
+  return !clusters.empty();
+}
+
 void Utilities::matrixToPoseArray(const Eigen::Matrix4f &mat, geometry_msgs::PoseArray &array) {
   // make sure the array.poses is clear when input
   Eigen::Quaternion<float> q;
@@ -1428,9 +1343,8 @@ bool Utilities::getCylinderPose(const PointCloudMono::Ptr& cloud, geometry_msgs:
   getCloudZInfo(cloud, z_mean, z_max, z_min, z_mid);
   (z == 0) ? (z_origin = z_mid) : (z_origin = z);
 
-  pcl::ModelCoefficients::Ptr coeff = getPlaneCoeff(z_mid);
   PointCloudMono::Ptr slice_2d(new PointCloudMono);
-  sliceCloudWithPlane(coeff, 0.001, cloud, slice_2d);
+  sliceCloudByZ(cloud, z_mid, 0.001, slice_2d);
 
   int sz = slice_2d->points.size();
   if (sz <= 2) return false;  // not enough for constructing a circum circle
@@ -1456,9 +1370,8 @@ bool Utilities::getBoxPose(const PointCloudMono::Ptr& cloud, geometry_msgs::Pose
   getCloudZInfo(cloud, z_mean, z_max, z_min, z_mid);
   (z == 0) ? (z_origin = z_mid) : (z_origin = z);
 
-  pcl::ModelCoefficients::Ptr coeff = getPlaneCoeff(z_mid);
   PointCloudMono::Ptr slice_2d(new PointCloudMono);
-  sliceCloudWithPlane(coeff, 0.001, cloud, slice_2d);
+  sliceCloudByZ(cloud, z_mid, 0.001, slice_2d);
   if (slice_2d->points.size() <= 2)
     return false;  // not enough for constructing a convex hull
 
@@ -1485,9 +1398,8 @@ bool Utilities::getBoxTopPose(const PointCloudMono::Ptr& cloud, geometry_msgs::P
   float z_mean, z_max, z_min, z_mid;
   getCloudZInfo(cloud, z_mean, z_max, z_min, z_mid);
 
-  pcl::ModelCoefficients::Ptr coeff = getPlaneCoeff(z_mean);
   PointCloudMono::Ptr slice_2d(new PointCloudMono);
-  sliceCloudWithPlane(coeff, 0.01, cloud, slice_2d);
+  sliceCloudByZ(cloud, z_mean, 0.01, slice_2d);
   if (slice_2d->points.size() <= 4) {
     ROS_WARN("not enough point");
     return false;  // not enough for constructing a convex hull
@@ -1528,13 +1440,6 @@ bool Utilities::getBoxTopPose(const PointCloudMono::Ptr& cloud, geometry_msgs::P
   return category >= 0;
 }
 
-void Utilities::computeHull(PointCloudMono::Ptr cloud_2d, PointCloudMono::Ptr &cloud_hull)
-{
-  pcl::ConvexHull<pcl::PointXYZ> hull;
-  hull.setInputCloud(cloud_2d);
-  hull.reconstruct(*cloud_hull);
-}
-
 void Utilities::getStraightRect2D(const PointCloudMono::Ptr &cloud, vector<pcl::PointXY> &rect,
                                   pcl::PointXY &center, float &width, float &height) {
 
@@ -1563,10 +1468,12 @@ void Utilities::getRotatedRect2D(const PointCloudMono::Ptr &cloud_2d, std::vecto
                                  pcl::PointXY &center, pcl::PointXY &edge_center,
                                  float &width, float &height, float &rotation)
 {
-  PointCloudMono::Ptr hull(new PointCloudMono);
-  computeHull(cloud_2d, hull);
-  vector<cv::Point2f> points = cloudToCVPoints(hull);
-  cv::RotatedRect rr = cv::minAreaRect(points);
+  // The convex hull is computed by OpenCV instead of qhull, which is not reentrant,
+  // so that this function could be called from multiple threads
+  vector<cv::Point2f> points = cloudToCVPoints(cloud_2d);
+  vector<cv::Point2f> hull;
+  cv::convexHull(points, hull);
+  cv::RotatedRect rr = cv::minAreaRect(hull);
 
   cv::Point2f vertices[4];
   rr.points(vertices);
@@ -1640,6 +1547,542 @@ bool Utilities::alignmentWithFPFH(PointCloudN::Ptr src_cloud, PointCloudFPFH::Pt
   }
 }
 
+bool Utilities::alignmentWithFPFH(PointCloudN::Ptr src_cloud, PointCloudFPFH::Ptr src_features,
+                                  PointCloudN::Ptr tgt_cloud, PointCloudFPFH::Ptr tgt_features,
+                                  Eigen::Matrix4f &transformation, PointCloudN::Ptr &src_aligned, float leaf,
+                                  double time_budget, float confidence,
+                                  float &fitness, float &inlier_ratio, int &iterations,
+                                  const AlignmentProgress &progress) {
+  const int max_iterations = 50000;
+  const int chunk = 500;
+  const int sample_num = 3;
+  const int randomness = 5;
+  const float similarity_sq = 0.9f * 0.9f;
+  const float inlier_fraction = 0.25f;
+  const float th_inlier = 2.5f * leaf;
+  const float th_inlier_sq = th_inlier * th_inlier;
+
+  fitness = FLT_MAX;
+  inlier_ratio = 0;
+  iterations = 0;
+  if (src_cloud->points.empty() || tgt_cloud->points.empty() || tgt_features->points.empty()) return false;
+  const int num = int(src_cloud->points.size());
+  const int k = min(randomness, int(tgt_features->points.size()));
+
+  // The nearest features of each source point are searched only once, each sample
+  // then picks one of them at random
+  pcl::KdTreeFLANN<FeatureFPFH> feature_tree;
+  feature_tree.setInputCloud(tgt_features);
+  vector<int> knn(size_t(num) * k, -1);
+  int feature_num = min(num, int(src_features->points.size()));
+#pragma omp parallel
+  {
+    vector<int> nn(k);
+    vector<float> nn_dis(k);
+#pragma omp for schedule(static)
+    for (int i = 0; i < feature_num; ++i) {
+      if (!std::isfinite(src_features->points[i].histogram[0])) continue;
+      if (feature_tree.nearestKSearch(src_features->points[i], k, nn, nn_dis) < k) continue;
+      copy(nn.begin(), nn.end(), knn.begin() + size_t(i) * k);
+    }
+  }
+  vector<int> candidates;
+  for (int i = 0; i < feature_num; ++i) {
+    if (knn[size_t(i) * k] >= 0) candidates.push_back(i);
+  }
+  if (int(candidates.size()) < sample_num) return false;
+
+  pcl::KdTreeFLANN<PointN> tree;
+  tree.setInputCloud(tgt_cloud);
+  vector<int> nn(1);
+  vector<float> nn_dis(1);
+  PointN query;
+
+  mt19937 rng(0);
+  uniform_int_distribution<int> pick_point(0, int(candidates.size()) - 1);
+  uniform_int_distribution<int> pick_feature(0, k - 1);
+  int src_ids[sample_num];
+  int tgt_ids[sample_num];
+  Eigen::Matrix<float, 3, sample_num> src_sample, tgt_sample;
+
+  auto start = chrono::steady_clock::now();
+  bool found = false;
+  int best_inliers = 0;
+  int required = max_iterations;
+  while (iterations < min(required, max_iterations)) {
+    for (int end = iterations + chunk; iterations < end && iterations < min(required, max_iterations);
+         ++iterations) {
+      bool distinct = true;
+      for (int a = 0; a < sample_num; ++a) {
+        src_ids[a] = candidates[pick_point(rng)];
+        tgt_ids[a] = knn[size_t(src_ids[a]) * k + pick_feature(rng)];
+        for (int b = 0; b < a; ++b) {
+          if (src_ids[a] == src_ids[b] || tgt_ids[a] == tgt_ids[b]) distinct = false;
+        }
+        const PointN &ps = src_cloud->points[src_ids[a]];
+        const PointN &pt = tgt_cloud->points[tgt_ids[a]];
+        src_sample.col(a) = Eigen::Vector3f(ps.x, ps.y, ps.z);
+        tgt_sample.col(a) = Eigen::Vector3f(pt.x, pt.y, pt.z);
+      }
+      if (!distinct) continue;
+
+      // Prerejection, the edges of the sampled polygons should have similar lengths
+      bool similar = true;
+      for (int a = 0; a < sample_num && similar; ++a) {
+        int b = (a + 1) % sample_num;
+        float ls = (src_sample.col(a) - src_sample.col(b)).squaredNorm();
+        float lt = (tgt_sample.col(a) - tgt_sample.col(b)).squaredNorm();
+        float longer = max(ls, lt);
+        similar = longer > 0 && min(ls, lt) / longer >= similarity_sq;
+      }
+      if (!similar) continue;
+
+      Eigen::Matrix4f hypothesis = Eigen::umeyama(src_sample, tgt_sample, false);
+      Eigen::Matrix3f rot = hypothesis.block<3, 3>(0, 0);
+      Eigen::Vector3f trans = hypothesis.block<3, 1>(0, 3);
+
+      // The counting stops once the hypothesis could not beat the best one
+      int count = 0;
+      float dis_sum = 0;
+      for (int i = 0; i < num && count + (num - i) >= best_inliers; ++i) {
+        const PointN &ps = src_cloud->points[i];
+        Eigen::Vector3f p = rot * Eigen::Vector3f(ps.x, ps.y, ps.z) + trans;
+        query.x = p.x();
+        query.y = p.y();
+        query.z = p.z();
+        if (tree.nearestKSearch(query, 1, nn, nn_dis) < 1 || nn_dis[0] >= th_inlier_sq) continue;
+        count++;
+        dis_sum += nn_dis[0];
+      }
+      if (count < inlier_fraction * num || count < best_inliers) continue;
+      if (count == best_inliers && dis_sum / count >= fitness) continue;
+
+      best_inliers = count;
+      transformation = hypothesis;
+      fitness = dis_sum / count;
+      found = true;
+
+      inlier_ratio = float(best_inliers) / num;
+      // Each sampled point takes one of its nearest features at random, so a sample
+      // is good only if all its points are inliers and take the right feature
+      double p_good = pow(double(inlier_ratio) / randomness, sample_num);
+      if (p_good >= 1.0) {
+        required = 0;
+      } else if (p_good > 0) {
+        required = int(ceil(log(1.0 - confidence) / log(1.0 - p_good)));
+      }
+    }
+
+    if (progress && !progress(iterations, fitness, inlier_ratio)) return false;
+
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (time_budget > 0 && elapsed >= time_budget) break;
+  }
+
+  if (found) {
+    if (!src_aligned) src_aligned.reset(new PointCloudN);
+    pcl::transformPointCloudWithNormals(*src_cloud, *src_aligned, transformation);
+  }
+  return found;
+}
+
+bool Utilities::refinePointToPlane(const PointCloudN::Ptr &src_cloud, const PointCloudN::Ptr &tgt_cloud,
+                                   Eigen::Matrix4f &transformation, float max_distance,
+                                   int max_iterations, float &rms, float &inlier_ratio) {
+  const size_t min_correspondences = 6;
+  rms = FLT_MAX;
+  inlier_ratio = 0;
+  if (src_cloud->points.size() < min_correspondences || tgt_cloud->points.empty()) return false;
+
+  pcl::KdTreeFLANN<PointN> tree;
+  tree.setInputCloud(tgt_cloud);
+  const float max_dis_sq = max_distance * max_distance;
+  const int num = int(src_cloud->points.size());
+
+  // The last round only evaluates the correspondences of the final transformation
+  bool converged = false;
+  for (int it = 0; it <= max_iterations; ++it) {
+    Eigen::Matrix3f rot = transformation.block<3, 3>(0, 0);
+    Eigen::Vector3f trans = transformation.block<3, 1>(0, 3);
+
+    // Normal equations of the linearized problem in (rx, ry, rz, tx, ty, tz)
+    Eigen::Matrix<double, 6, 6> ata = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> atb = Eigen::Matrix<double, 6, 1>::Zero();
+    double err_sum = 0;
+    size_t count = 0;
+
+#pragma omp parallel
+    {
+      Eigen::Matrix<double, 6, 6> ata_local = Eigen::Matrix<double, 6, 6>::Zero();
+      Eigen::Matrix<double, 6, 1> atb_local = Eigen::Matrix<double, 6, 1>::Zero();
+      double err_local = 0;
+      size_t count_local = 0;
+      vector<int> nn(1);
+      vector<float> nn_dis(1);
+      PointN query;
+
+#pragma omp for schedule(static) nowait
+      for (int i = 0; i < num; ++i) {
+        const PointN &ps = src_cloud->points[i];
+        Eigen::Vector3f p = rot * Eigen::Vector3f(ps.x, ps.y, ps.z) + trans;
+        query.x = p.x();
+        query.y = p.y();
+        query.z = p.z();
+        if (tree.nearestKSearch(query, 1, nn, nn_dis) < 1 || nn_dis[0] > max_dis_sq) continue;
+        const PointN &pt = tgt_cloud->points[nn[0]];
+        Eigen::Vector3f n(pt.normal_x, pt.normal_y, pt.normal_z);
+        if (!std::isfinite(n.x()) || n.squaredNorm() < 0.5f) continue;
+
+        double r = (p - Eigen::Vector3f(pt.x, pt.y, pt.z)).dot(n);
+        Eigen::Vector3f c = p.cross(n);
+        Eigen::Matrix<double, 6, 1> j;
+        j << c.x(), c.y(), c.z(), n.x(), n.y(), n.z();
+        ata_local.noalias() += j * j.transpose();
+        atb_local.noalias() -= j * r;
+        err_local += r * r;
+        count_local++;
+      }
+
+#pragma omp critical
+      {
+        ata += ata_local;
+        atb += atb_local;
+        err_sum += err_local;
+        count += count_local;
+      }
+    }
+
+    if (count < min_correspondences) return false;
+    rms = float(sqrt(err_sum / count));
+    inlier_ratio = float(count) / num;
+    if (converged || it == max_iterations) break;
+
+    Eigen::Matrix<double, 6, 1> x = ata.ldlt().solve(atb);
+    if (!x.allFinite()) return false;
+    Eigen::Vector3d omega = x.head<3>();
+    Eigen::Matrix4f delta = Eigen::Matrix4f::Identity();
+    if (omega.norm() > 0) {
+      delta.block<3, 3>(0, 0) = Eigen::AngleAxisd(omega.norm(), omega.normalized()).toRotationMatrix().cast<float>();
+    }
+    delta.block<3, 1>(0, 3) = x.tail<3>().cast<float>();
+    transformation = delta * transformation;
+
+    // Converged when the update is negligible
+    converged = omega.norm() < 1e-5 && x.tail<3>().norm() < 1e-6;
+  }
+  return true;
+}
+
+void Utilities::estimateGravityFeatures(const PointCloudN::Ptr &cloud, float base_z, float radius,
+                                        cv::Mat &features) {
+  const int elevation_bins = 6;
+  const int radial_bins = 3;
+  const int height_bins = 3;
+  features = cv::Mat::zeros(int(cloud->points.size()), gravity_feature_dim_, CV_32F);
+  if (cloud->points.empty()) return;
+
+  pcl::KdTreeFLANN<PointN> tree;
+  tree.setInputCloud(cloud);
+  const int num = int(cloud->points.size());
+
+#pragma omp parallel
+  {
+    vector<int> nn;
+    vector<float> nn_dis;
+
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < num; ++i) {
+      const PointN &p = cloud->points[i];
+      float *f = features.ptr<float>(i);
+      // Height above the supporting plane, in unit of the radius
+      f[0] = (p.z - base_z) / radius;
+      if (tree.radiusSearch(p, radius, nn, nn_dis) <= 1) continue;
+
+      float *elevation = f + 1;
+      float *context = elevation + elevation_bins;
+      int count = 0;
+      for (int n : nn) {
+        const PointN &q = cloud->points[n];
+        if (std::isfinite(q.normal_z)) {
+          // Angle between the normal and the gravity, in [0, pi/2]
+          float angle = acos(min(1.0f, fabs(q.normal_z)));
+          elevation[min(elevation_bins - 1, int(angle / M_PI_2 * elevation_bins))] += 1;
+        }
+        if (n == i) continue;
+
+        // Only the radial distance in xy is used, so that the context does not depend on yaw
+        float dx = q.x - p.x;
+        float dy = q.y - p.y;
+        float dz = q.z - p.z;
+        int r = min(radial_bins - 1, int(sqrt(dx * dx + dy * dy) / radius * radial_bins));
+        int h = dz < -0.25f * radius ? 0 : (dz > 0.25f * radius ? 2 : 1);
+        context[r * height_bins + h] += 1;
+        count++;
+      }
+      float inv = 1.0f / nn.size();
+      for (int b = 0; b < elevation_bins; ++b) elevation[b] *= inv;
+      if (count > 0) {
+        inv = 1.0f / count;
+        for (int b = 0; b < radial_bins * height_bins; ++b) context[b] *= inv;
+      }
+    }
+  }
+}
+
+void Utilities::matchGravityFeatures(const cv::Mat &src_features, const cv::Mat &tgt_features,
+                                     vector<int> &matches) {
+  matches.assign(src_features.rows, -1);
+  if (src_features.empty() || tgt_features.empty()) return;
+
+  cv::flann::Index index(tgt_features, cv::flann::KDTreeIndexParams(4));
+  cv::Mat indices, dists;
+  index.knnSearch(src_features, indices, dists, 1, cv::flann::SearchParams(32));
+  for (int i = 0; i < src_features.rows; ++i) {
+    matches[i] = indices.at<int>(i, 0);
+  }
+}
+
+// Apply the rotation about z given by (c, s) = (cos(yaw), sin(yaw)) and the translation
+static inline Eigen::Vector3f transformYaw(const Eigen::Vector3f &p, float c, float s,
+                                           float tx, float ty, float tz)
+{
+  return Eigen::Vector3f(c * p.x() - s * p.y() + tx, s * p.x() + c * p.y() + ty, p.z() + tz);
+}
+
+// 2D Procrustes: the yaw and xy translation best mapping src[ids[i]] to tgt[ids[i]] in least squares
+static bool fitYaw2D(const vector<Eigen::Vector3f> &src, const vector<Eigen::Vector3f> &tgt,
+                     const vector<int> &ids, float &yaw, float &tx, float &ty)
+{
+  if (ids.size() < 2) return false;
+  double csx = 0, csy = 0, ctx = 0, cty = 0;
+  for (int i : ids) {
+    csx += src[i].x();
+    csy += src[i].y();
+    ctx += tgt[i].x();
+    cty += tgt[i].y();
+  }
+  csx /= ids.size();
+  csy /= ids.size();
+  ctx /= ids.size();
+  cty /= ids.size();
+
+  // The yaw maximizes cos(yaw) * a + sin(yaw) * b
+  double a = 0, b = 0;
+  for (int i : ids) {
+    double sx = src[i].x() - csx;
+    double sy = src[i].y() - csy;
+    double qx = tgt[i].x() - ctx;
+    double qy = tgt[i].y() - cty;
+    a += sx * qx + sy * qy;
+    b += sx * qy - sy * qx;
+  }
+  if (a == 0 && b == 0) return false;
+  yaw = float(atan2(b, a));
+  double c = cos(yaw);
+  double s = sin(yaw);
+  tx = float(ctx - (c * csx - s * csy));
+  ty = float(cty - (s * csx + c * csy));
+  return true;
+}
+
+bool Utilities::alignment4DoF(PointCloudN::Ptr src_cloud, PointCloudFPFH::Ptr src_features,
+                              PointCloudN::Ptr tgt_cloud, PointCloudFPFH::Ptr tgt_features, float tz,
+                              Eigen::Matrix4f &transformation, float leaf, float confidence,
+                              float &fitness, float &inlier_ratio, const AlignmentProgress &progress) {
+  fitness = FLT_MAX;
+  inlier_ratio = 0;
+  if (tgt_features->points.empty()) return false;
+
+  // Correspondences by the nearest feature
+  pcl::KdTreeFLANN<FeatureFPFH> feature_tree;
+  feature_tree.setInputCloud(tgt_features);
+  vector<int> matches(src_cloud->points.size(), -1);
+  vector<int> nn(1);
+  vector<float> nn_dis(1);
+  for (size_t i = 0; i < src_features->points.size() && i < src_cloud->points.size(); ++i) {
+    if (!std::isfinite(src_features->points[i].histogram[0])) continue;
+    if (feature_tree.nearestKSearch(src_features->points[i], 1, nn, nn_dis) < 1) continue;
+    matches[i] = nn[0];
+  }
+  return alignment4DoF(src_cloud, tgt_cloud, matches, tz, transformation, leaf, confidence,
+                       fitness, inlier_ratio, progress);
+}
+
+bool Utilities::alignment4DoF(PointCloudN::Ptr src_cloud, PointCloudN::Ptr tgt_cloud, const vector<int> &matches,
+                              float tz, Eigen::Matrix4f &transformation, float leaf, float confidence,
+                              float &fitness, float &inlier_ratio, const AlignmentProgress &progress) {
+  const int max_iterations = 10000;
+  const int refine_iterations = 10;
+  const float th_inlier = 2.5f * leaf;
+  const float th_inlier_sq = th_inlier * th_inlier;
+
+  fitness = FLT_MAX;
+  inlier_ratio = 0;
+  if (src_cloud->points.empty() || tgt_cloud->points.empty()) return false;
+
+  // Correspondences violating the known z offset are dropped
+  vector<Eigen::Vector3f> src, tgt;
+  for (size_t i = 0; i < matches.size() && i < src_cloud->points.size(); ++i) {
+    if (matches[i] < 0) continue;
+    const PointN &ps = src_cloud->points[i];
+    const PointN &pt = tgt_cloud->points[matches[i]];
+    if (fabs(pt.z - ps.z - tz) > th_inlier) continue;
+    src.emplace_back(ps.x, ps.y, ps.z);
+    tgt.emplace_back(pt.x, pt.y, pt.z);
+  }
+  int num = int(src.size());
+  if (num < 3) return false;
+
+  // RANSAC with 2 correspondences for each hypothesis
+  mt19937 rng(0);
+  uniform_int_distribution<int> pick(0, num - 1);
+  int best_count = 0;
+  // Mean squared distance of the inliers of the best hypothesis, reported as its fitness
+  float best_fitness = FLT_MAX;
+  float best_yaw = 0, best_tx = 0, best_ty = 0;
+  int required = max_iterations;
+  for (int it = 0; it < min(required, max_iterations); ++it) {
+    if (progress && it > 0 && it % 500 == 0 && !progress(it, best_fitness, float(best_count) / num)) return false;
+
+    int i = pick(rng);
+    int j = pick(rng);
+    if (i == j) continue;
+    Eigen::Vector2f ds = (src[j] - src[i]).head<2>();
+    Eigen::Vector2f dt = (tgt[j] - tgt[i]).head<2>();
+    float ls = ds.norm();
+    // Short pairs give unstable yaw, and pairs of different lengths can not be rigid
+    if (ls < 2 * th_inlier || fabs(ls - dt.norm()) > th_inlier) continue;
+
+    float yaw = atan2(dt.y(), dt.x()) - atan2(ds.y(), ds.x());
+    float c = cos(yaw);
+    float s = sin(yaw);
+    Eigen::Vector3f ms = 0.5f * (src[i] + src[j]);
+    Eigen::Vector3f mt = 0.5f * (tgt[i] + tgt[j]);
+    float tx = mt.x() - (c * ms.x() - s * ms.y());
+    float ty = mt.y() - (s * ms.x() + c * ms.y());
+
+    int count = 0;
+    float dis_sum = 0;
+    for (int k = 0; k < num; ++k) {
+      float dis = (transformYaw(src[k], c, s, tx, ty, tz) - tgt[k]).squaredNorm();
+      if (dis < th_inlier_sq) {
+        count++;
+        dis_sum += dis;
+      }
+    }
+    if (count > best_count) {
+      best_count = count;
+      best_fitness = dis_sum / count;
+      best_yaw = yaw;
+      best_tx = tx;
+      best_ty = ty;
+      double w = double(count) / num;
+      if (w * w >= 1.0) required = 0;
+      else required = int(ceil(log(1.0 - confidence) / log(1.0 - w * w)));
+    }
+  }
+  if (best_count < 3) return false;
+
+  // Refine on the inlier correspondences
+  vector<int> ids;
+  for (int round = 0; round < 2; ++round) {
+    float c = cos(best_yaw);
+    float s = sin(best_yaw);
+    ids.clear();
+    for (int k = 0; k < num; ++k) {
+      if ((transformYaw(src[k], c, s, best_tx, best_ty, tz) - tgt[k]).squaredNorm() < th_inlier_sq) {
+        ids.push_back(k);
+      }
+    }
+    if (!fitYaw2D(src, tgt, ids, best_yaw, best_tx, best_ty)) break;
+  }
+
+  // Refine on the nearest neighbours of all source points
+  transformation = Eigen::Matrix4f::Identity();
+  transformation(0, 0) = cos(best_yaw);
+  transformation(0, 1) = -sin(best_yaw);
+  transformation(1, 0) = sin(best_yaw);
+  transformation(1, 1) = cos(best_yaw);
+  transformation(0, 3) = best_tx;
+  transformation(1, 3) = best_ty;
+  transformation(2, 3) = tz;
+  if (!refine4DoF(src_cloud, tgt_cloud, transformation, th_inlier, refine_iterations, fitness, inlier_ratio)) {
+    return false;
+  }
+  return inlier_ratio >= 0.25f;
+}
+
+bool Utilities::refine4DoF(const PointCloudN::Ptr &src_cloud, const PointCloudN::Ptr &tgt_cloud,
+                           Eigen::Matrix4f &transformation, float max_distance, int max_iterations,
+                           float &fitness, float &inlier_ratio) {
+  fitness = FLT_MAX;
+  inlier_ratio = 0;
+  if (src_cloud->points.empty() || tgt_cloud->points.empty()) return false;
+
+  // Only yaw and xy are refined, z is kept
+  float best_yaw = atan2(transformation(1, 0), transformation(0, 0));
+  float best_tx = transformation(0, 3);
+  float best_ty = transformation(1, 3);
+  const float tz = transformation(2, 3);
+  const float th_sq = max_distance * max_distance;
+
+  pcl::KdTreeFLANN<PointN> tree;
+  tree.setInputCloud(tgt_cloud);
+  vector<int> nn(1);
+  vector<float> nn_dis(1);
+  vector<int> ids;
+  vector<Eigen::Vector3f> src_all, tgt_nn;
+  src_all.reserve(src_cloud->points.size());
+  for (const auto & p : src_cloud->points) {
+    src_all.emplace_back(p.x, p.y, p.z);
+  }
+  tgt_nn.resize(src_all.size());
+  double dis_sum = 0;
+  for (int it = 0; it <= max_iterations; ++it) {
+    float c = cos(best_yaw);
+    float s = sin(best_yaw);
+    ids.clear();
+    dis_sum = 0;
+    PointN query;
+    for (size_t k = 0; k < src_all.size(); ++k) {
+      Eigen::Vector3f p = transformYaw(src_all[k], c, s, best_tx, best_ty, tz);
+      query.x = p.x();
+      query.y = p.y();
+      query.z = p.z();
+      if (tree.nearestKSearch(query, 1, nn, nn_dis) < 1 || nn_dis[0] >= th_sq) continue;
+      const PointN &pt = tgt_cloud->points[nn[0]];
+      tgt_nn[k] = Eigen::Vector3f(pt.x, pt.y, pt.z);
+      ids.push_back(int(k));
+      dis_sum += nn_dis[0];
+    }
+    // The last round only evaluates the result
+    if (it == max_iterations) break;
+
+    float yaw = best_yaw, tx = best_tx, ty = best_ty;
+    if (!fitYaw2D(src_all, tgt_nn, ids, yaw, tx, ty)) break;
+    float change = fabs(yaw - best_yaw) + fabs(tx - best_tx) + fabs(ty - best_ty);
+    best_yaw = yaw;
+    best_tx = tx;
+    best_ty = ty;
+    if (change < 1e-4f) {
+      it = max_iterations - 1;
+    }
+  }
+  if (ids.empty()) return false;
+
+  fitness = float(dis_sum / ids.size());
+  inlier_ratio = float(ids.size()) / src_all.size();
+  transformation = Eigen::Matrix4f::Identity();
+  transformation(0, 0) = cos(best_yaw);
+  transformation(0, 1) = -sin(best_yaw);
+  transformation(1, 0) = sin(best_yaw);
+  transformation(1, 1) = cos(best_yaw);
+  transformation(0, 3) = best_tx;
+  transformation(1, 3) = best_ty;
+  transformation(2, 3) = tz;
+  return true;
+}
+
 void Utilities::quaternionFromMatrix(Eigen::Matrix4f mat, Eigen::Quaternion<float> &q) {
   auto t = mat.trace();
   if (t > mat(3, 3)) {
@@ -1682,16 +2125,6 @@ void Utilities::quaternionFromMatrix(Eigen::Matrix4f mat, Eigen::Quaternion<floa
   q.w() *= d;
 }
 
-pcl::ModelCoefficients::Ptr Utilities::getPlaneCoeff(float z) {
-  // Plane function: ax + by + cz + d = 0, here coeff[3] = d = -cz
-  pcl::ModelCoefficients::Ptr coeff(new pcl::ModelCoefficients);
-  coeff->values.push_back(0.0);
-  coeff->values.push_back(0.0);
-  coeff->values.push_back(1.0);
-  coeff->values.push_back(-z);
-  return coeff;
-}
-
 std::vector<cv::Point2f> Utilities::cloudToCVPoints(PointCloudMono::Ptr cloud_hull) {
   std::vector<cv::Point2f> points;
   for (std::size_t i = 0; i < cloud_hull->size(); ++i) {
@@ -1714,18 +2147,6 @@ void Utilities::quaternionFromPlanarRotation(float rotation, Eigen::Quaternion<f
   quaternionFromMatrix(mat, q);
 }
 
-void Utilities::combineCloud(PointCloudMono::Ptr cloud_a, PointCloudMono::Ptr cloud_b, PointCloudMono::Ptr &cloud_out) {
-  int sz_a = cloud_a->points.size();
-  int sz_b = cloud_b->points.size();
-  cloud_out->is_dense = false;
-  for (std::size_t a = 0; a < sz_a; ++a) {
-    cloud_out->points.push_back(cloud_a->points[a]);
-  }
-  for (std::size_t b = 0; b < sz_b; ++b) {
-    cloud_out->points.push_back(cloud_b->points[b]);
-  }
-}
-
 
 // declare all templates use case, otherwise undefined symbol error will raise
 // refer: https://raymii.org/s/snippets/Cpp_template_definitions_in_a_cpp_file_instead_of_header.html
@@ -1740,7 +2161,4 @@ template void Utilities::convertCloudType<PointCloudMono::Ptr, PointCloudN::Ptr>
 template void Utilities::getCloudZInfo<PointCloudMono::Ptr>(PointCloudMono::Ptr cloud_in, float &z_mean, float &z_max, float &z_min, float &z_mid);
 template void Utilities::getCloudZInfo<PointCloudRGBN::Ptr>(PointCloudRGBN::Ptr cloud_in, float &z_mean, float &z_max, float &z_min, float &z_mid);
 
-template void Utilities::sliceCloudWithPlane<PointCloudMono::Ptr, PointCloudMono::Ptr>(pcl::ModelCoefficients::Ptr coeff_in,
-                                                                                       float th_distance, PointCloudMono::Ptr cloud_in,
-                                                                                       PointCloudMono::Ptr &cloud_out);
 
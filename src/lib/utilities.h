@@ -74,6 +74,8 @@
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include <boost/function.hpp>
+
 //Eigen
 #include <Eigen/Core>
 #include <Eigen/Dense>
@@ -93,12 +95,19 @@ typedef pcl::PointCloud<pcl::Normal> CloudN;
 typedef pcl::PointCloud<pcl::PointNormal> PointCloudN;
 typedef pcl::visualization::PointCloudColorHandlerCustom<PointN> ColorHandler;
 
+// Called during alignment with the number of iterations, the best fitness and inlier
+// ratio so far, the alignment is cancelled if it returns false
+typedef boost::function<bool(int, float, float)> AlignmentProgress;
+
 
 class Utilities
 {
 public:
   Utilities();
 
+  // Dimension of the gravity aligned feature, see estimateGravityFeatures
+  static const int gravity_feature_dim_ = 16;
+
   static bool calRANSAC(const PointCloudMono::ConstPtr& cloud_3d_in, float dt, float &grad);
   static void calRegionGrowing(PointCloudRGBN::Ptr cloud_in, int minsz, int maxsz, int nb, int smooth,
                                pcl::PointCloud<pcl::Normal>::Ptr normals, std::vector<pcl::PointIndices> &inliers);
@@ -112,7 +121,10 @@ public:
   static bool checkWithIn(const pcl::PointIndices::Ptr& ref_inliers, const pcl::PointIndices::Ptr& tgt_inliers);
 
   /**
-   * Extract clusters from given point cloud with EuclideanClusterExtraction
+   * Extract Euclidean clusters from given point cloud. Instead of a kd-tree, the points
+   * are bucketed into a 3D grid and connected components are found over neighbouring
+   * cells. The result is the same as EuclideanClusterExtraction, with the clusters
+   * ordered by size, the largest first.
    * @param cloud_in Mono point cloud
    * @param cluster_indices Vector of PointIndices
    * @param th_cluster ClusterTolerance
@@ -123,9 +135,17 @@ public:
                               std::vector<pcl::PointIndices> &cluster_indices,
                               float th_cluster, int minsize, int maxsize);
 
-  template <typename T, typename U>
-  static void sliceCloudWithPlane(pcl::ModelCoefficients::Ptr coeff_in, float th_distance,
-                                  T cloud_in, U &cloud_out);
+  /**
+   * Slice the cloud with the horizontal plane Z=z and project the slice onto it. The
+   * band around z is widened by 1 mm at most 4 times until it contains min_num points.
+   * @param cloud_in Input cloud
+   * @param z Height of the plane
+   * @param th_distance Initial half width of the band
+   * @param cloud_out Points in the band with z set to the plane z
+   * @param min_num Min number of points in the band
+   */
+  static void sliceCloudByZ(const PointCloudMono::Ptr& cloud_in, float z, float th_distance,
+                            PointCloudMono::Ptr &cloud_out, size_t min_num = 4);
 
   static void downSampling(const PointCloudMono::Ptr& cloud_in, PointCloudMono::Ptr &cloud_out,
                            float grid_sz = 0, float z_sz = 0);
@@ -153,6 +173,104 @@ public:
                                 PointCloudN::Ptr tgt_cloud, PointCloudFPFH::Ptr tgt_features,
                                 Eigen::Matrix4f &transformation, PointCloudN::Ptr &src_aligned, float leaf = 0.005f);
 
+  /**
+   * Align with FPFH features like above, with the same sampling, prerejection and inlier
+   * threshold, but the nearest features are searched only once for all iterations and the
+   * hypothesis with the most inliers is kept. RANSAC runs in chunks of iterations and stops
+   * as soon as the best hypothesis implies the given confidence by the stopping rule
+   * N = log(1 - confidence) / log(1 - (w / k)^3), where w is its inlier ratio and k = 5 is
+   * the number of nearest features each sampled point picks from, or the time budget is
+   * used up. At most 50000 iterations are run.
+   * @param time_budget Max wall time in seconds, 0 for no limit
+   * @param confidence Probability of having drawn an all-inlier sample, e.g. 0.99
+   * @param fitness Output fitness score (mean squared distance of the inliers) of the result
+   * @param inlier_ratio Output ratio of source points being inliers of the result
+   * @param iterations Output number of RANSAC iterations run
+   * @param progress Called after each chunk of iterations, return false to cancel
+   * @return False if failed or cancelled
+   */
+  static bool alignmentWithFPFH(PointCloudN::Ptr src_cloud, PointCloudFPFH::Ptr src_features,
+                                PointCloudN::Ptr tgt_cloud, PointCloudFPFH::Ptr tgt_features,
+                                Eigen::Matrix4f &transformation, PointCloudN::Ptr &src_aligned, float leaf,
+                                double time_budget, float confidence,
+                                float &fitness, float &inlier_ratio, int &iterations,
+                                const AlignmentProgress &progress = AlignmentProgress());
+
+  /**
+   * Refine the transformation from the source to the target with point-to-plane ICP,
+   * using the normals of the target. Correspondences are searched in parallel.
+   * @param transformation Initial transformation as input, refined one as output
+   * @param max_distance Correspondences farther than this are rejected
+   * @param max_iterations Max number of iterations
+   * @param rms Output root mean square of the point-to-plane distances of the correspondences,
+   * evaluated with the final transformation
+   * @param inlier_ratio Output ratio of source points having a correspondence with the final
+   * transformation
+   * @return False if too few correspondences are found
+   */
+  static bool refinePointToPlane(const PointCloudN::Ptr &src_cloud, const PointCloudN::Ptr &tgt_cloud,
+                                 Eigen::Matrix4f &transformation, float max_distance,
+                                 int max_iterations, float &rms, float &inlier_ratio);
+
+  /**
+   * Align the source to the target with only yaw and xy translation unknown, which is the
+   * case for an object model in its resting pose and an object standing on a horizontal
+   * plane. Yaw hypotheses are sampled from 2 FPFH correspondences by RANSAC, and the best
+   * one is refined by 2D Procrustes on its inliers and then on nearest neighbours.
+   * @param tz Known translation in z from the source to the target
+   * @param confidence RANSAC stops once the best hypothesis reaches this confidence
+   * @param fitness Output mean squared distance of the inliers
+   * @param inlier_ratio Output ratio of source points being inliers of the result
+   * @param progress Called every 500 RANSAC iterations, return false to cancel
+   * @return True if at least a quarter of the source points are inliers, false if cancelled
+   */
+  static bool alignment4DoF(PointCloudN::Ptr src_cloud, PointCloudFPFH::Ptr src_features,
+                            PointCloudN::Ptr tgt_cloud, PointCloudFPFH::Ptr tgt_features, float tz,
+                            Eigen::Matrix4f &transformation, float leaf, float confidence,
+                            float &fitness, float &inlier_ratio,
+                            const AlignmentProgress &progress = AlignmentProgress());
+
+  /**
+   * Same as above with given correspondences.
+   * @param matches Index of the corresponding target point of each source point, -1 for none
+   */
+  static bool alignment4DoF(PointCloudN::Ptr src_cloud, PointCloudN::Ptr tgt_cloud, const std::vector<int> &matches,
+                            float tz, Eigen::Matrix4f &transformation, float leaf, float confidence,
+                            float &fitness, float &inlier_ratio,
+                            const AlignmentProgress &progress = AlignmentProgress());
+
+  /**
+   * Refine the transformation from the source to the target with ICP constrained to yaw and
+   * xy translation, the z translation is kept and roll and pitch are dropped. Used as the last
+   * step of alignment4DoF and for tracking objects on the plane.
+   * @param transformation Initial transformation as input, refined one as output
+   * @param max_distance Correspondences farther than this are rejected
+   * @param max_iterations Max number of iterations
+   * @param fitness Output mean squared distance of the correspondences of the result
+   * @param inlier_ratio Output ratio of source points having a correspondence in the result
+   * @return False if no correspondence is found
+   */
+  static bool refine4DoF(const PointCloudN::Ptr &src_cloud, const PointCloudN::Ptr &tgt_cloud,
+                         Eigen::Matrix4f &transformation, float max_distance, int max_iterations,
+                         float &fitness, float &inlier_ratio);
+
+  /**
+   * Compute features of the points for objects standing upright on a horizontal plane,
+   * which are cheaper than FPFH. Each row of the features contains the height above the
+   * plane, the histogram of the normal elevation of the neighbours, and the histogram of
+   * the neighbours in (xy radial distance, z offset), none of which depends on the yaw.
+   * @param cloud Cloud with normals in a frame whose z axis is against the gravity
+   * @param base_z Height of the supporting plane
+   * @param radius Radius of the neighbourhood
+   * @param features Output CV_32F matrix with gravity_feature_dim_ columns, one row for each point
+   */
+  static void estimateGravityFeatures(const PointCloudN::Ptr &cloud, float base_z, float radius,
+                                      cv::Mat &features);
+
+  /// Match each source feature to its nearest target feature with FLANN, -1 if none
+  static void matchGravityFeatures(const cv::Mat &src_features, const cv::Mat &tgt_features,
+                                   std::vector<int> &matches);
+
   /**
    * @brief getClosestPoint
    * Given line segment (p1,p2) and point p, get the closest point p_c of p on (p1,p2)
@@ -218,12 +336,6 @@ public:
   static bool isInVector(int id, std::vector<int> vec, int &pos);
   static bool isInVector(int id, std::vector<int> &vec);
 
-  static void matchID(std::vector<std::vector<float> > global, std::vector<std::vector<float> > local,
-                      std::vector<int> in, std::vector<int> &out, int feature_dim);
-
-  static bool mergeOrReplace(size_t g_id, std::vector<int> l_ids, size_t q_id,
-                             std::vector<std::vector<float> > global, std::vector<std::vector<float> > local);
-
   static void msgToCloud(const PointCloud::ConstPtr& msg, PointCloudMono::Ptr cloud);
 
   static bool normalAnalysis(const CloudN::Ptr& cloud, float th_angle);
@@ -278,13 +390,36 @@ public:
   template <typename T>
   static inline bool isPointCloudValid(T cloud) { return cloud->empty() == 0; }
 
-  static bool getClustersUponPlane(const PointCloudMono::Ptr& src_cloud, const PointCloudMono::Ptr& contour, std::vector<PointCloudMono::Ptr> &clusters);
+  /**
+   * Get the clusters of points above the plane represented by the contour.
+   * @param src_cloud Source cloud in the same frame with the contour
+   * @param contour Ordered contour vertices of the plane
+   * @param clusters Output clusters
+   * @param resolution Cell size of the mask rasterized from the contour
+   */
+  static bool getClustersUponPlane(const PointCloudMono::Ptr& src_cloud, const PointCloudMono::Ptr& contour,
+                                   std::vector<PointCloudMono::Ptr> &clusters, float resolution = 0.01);
+
+  /**
+   * Get the clusters of points above the plane from an organized cloud in image space.
+   * Pixels above the plane and inside the contour are masked, then grouped by connected
+   * components over 4-neighbours, where neighbours further than th_cluster in 3D are
+   * regarded as separated by a depth discontinuity.
+   * @param src_cloud Organized source cloud in the same frame with the contour, invalid pixels are NaN
+   * @param contour Ordered contour vertices of the plane
+   * @param clusters Output clusters
+   * @param resolution Cell size of the mask rasterized from the contour
+   * @param th_cluster Max distance between neighbouring pixels in one cluster
+   */
+  static bool getClustersUponPlaneOrganized(const PointCloudMono::Ptr& src_cloud, const PointCloudMono::Ptr& contour,
+                                            std::vector<PointCloudMono::Ptr> &clusters, float resolution = 0.01,
+                                            float th_cluster = 0.01);
 
   /**
    * Determine whether a given point p in XY plane is within a contour C in the same plane.
-   * The idea is, if p in C, then the angles form by (pv_i, pv_i+1) for i in [0, N] should
-   * be equal to 2 PI, where N is the total number of vertexes of C. Otherwise, the
-   * sum of angles should smaller than 2 PI.
+   * The idea is, if p in C, then the signed angles form by (pv_i, pv_i+1) for i in [0, N]
+   * should sum up to +/- 2 PI, where N is the total number of vertexes of C. Otherwise, the
+   * sum of angles should be 0. Since the angles are signed, C could be concave.
    *
    * This function do require the contour is ordered clockwise or anti-clockwise.
    *
@@ -352,14 +487,10 @@ public:
   static void getRotatedRect2D(const PointCloudMono::Ptr &cloud_2d, std::vector<pcl::PointXY> &rect,
                                pcl::PointXY &center, pcl::PointXY &edge_center, float &width, float &height, float &rotation);
 
-  static void computeHull(PointCloudMono::Ptr cloud_2d, PointCloudMono::Ptr &cloud_hull);
-
   static void quaternionFromMatrix(Eigen::Matrix4f mat, Eigen::Quaternion<float> &q);
 
   static void quaternionFromPlanarRotation(float rotation, Eigen::Quaternion<float> &q);
 
-  static void combineCloud(PointCloudMono::Ptr cloud_a, PointCloudMono::Ptr cloud_b, PointCloudMono::Ptr &cloud_out);
-
 private:
   static bool calNormalMean(Eigen::Matrix3Xf data, std::vector<int> part1, std::vector<int> part2,
                             Eigen::Vector3f &mean_part1, Eigen::Vector3f &mean_part2);
@@ -371,16 +502,6 @@ private:
 
   static bool isIntersect(pcl::PointXY p1, pcl::PointXY p2, pcl::PointXY p3, pcl::PointXY p4);
 
-  static bool isInVector(int id, std::vector<std::vector<int> > vec, int &pos);
-
-  static void matFill(std::vector<std::vector<float> > features, cv::Mat &out);
-
-  static void matNormalize(cv::Mat query_in, cv::Mat train_in, cv::Mat &query_out, cv::Mat &train_out);
-
-  static void searchAvailableID(std::vector<int> id_used, std::vector<int> &id_ava, size_t limit);
-
-  static pcl::ModelCoefficients::Ptr getPlaneCoeff(float z);
-
   static std::vector<cv::Point2f> cloudToCVPoints(PointCloudMono::Ptr cloud_hull);
 
   // MeshKit